@@ -6,26 +6,102 @@
 /* Ringing delay in seconds */
 #define RINGINGDELAY 16
 
+/* Delay in milliseconds between looking for readers of file_out and call_out */
+#define READERDELAY 250
+
+/* Maximum number of simultaneous file transfers per friend in each direction */
+#define MAXTRANSFERS 4
+
+/* Read-ahead buffer of a file transfer in bytes */
+#define TXBUFSIZE (64 * 1024)
+
+/* Receive buffer of a file transfer in bytes; the sender is paused when
+ * more than RXHIWAT bytes wait for file_out and resumed below RXLOWAT */
+#define RXBUFSIZE (256 * 1024)
+#define RXHIWAT   (192 * 1024)
+#define RXLOWAT   (64 * 1024)
+
+/* Files saved to file_dir are written DISKBLOCK bytes at a time and
+ * flushed to disk every SYNCBYTES bytes */
+#define DISKBLOCK (64 * 1024)
+#define SYNCBYTES (8 * 1024 * 1024)
+
+/* Seconds a receive cut off by the friend going offline waits for the
+ * friend to offer the file again once it is back, and between tries to
+ * offer a file toxcore turned down */
+#define RESUMEDELAY 60
+
+/* Interval in ms at which the stats files of transfers are updated */
+#define STATSDELAY 1000
+
+/* Window of a file sent through broadcast that is shared by all
+ * friends, those more than a window behind read their chunks on their own */
+#define SHAREBUFSIZE (1024 * 1024)
+
+/* Interval in ms at which spool directories are checked for new files */
+#define SPOOLDELAY 2000
+
+/* Cap in bytes per second on file data sent to all friends, and to a
+ * friend while in a call with it; 0 means no cap */
+#define FILERATE     0
+#define FILECALLRATE (128 * 1024)
+
 /* Maximum number of simultaneous calls */
 #define MAXCALLS 8
 
-/* Audio settings definition */
+/* Audio format of call_in and call_out unless call_format sets one;
+ * AUDIOSAMPLERATE must be one opus codes: 8, 12, 16, 24 or 48 kHz */
 #define AUDIOCHANNELS     1
 #define AUDIOBITRATE      32
 #define AUDIOFRAME        20
 #define AUDIOSAMPLERATE   48000
 
-/* Video settings definition */
+/* Received audio is held back at least JITTERDELAY ms, more when it
+ * arrives unevenly, and at most JITTERMAX ms before it is dropped */
+#define JITTERDELAY       60
+#define JITTERMAX         400
+
+/* Frames queued between the loop and the audio thread each way */
+#define AVQUEUE           32
+
+/* Bounds in kbit/s of the audio bitrate, which starts at AUDIOBITRATE
+ * and follows send failures and toxav's suggestions every BITRATEDELAY ms */
+#define AUDIOBITRATEMIN   8
+#define AUDIOBITRATEMAX   64
+#define BITRATEDELAY      2000
+
+/* Frames on call_in below VADLEVEL dBFS are not sent once they have
+ * been for VADHANGOVER ms, but for one of comfort noise every VADNOISE
+ * ms; VADLEVEL 0 sends all frames */
+#define VADLEVEL          -50
+#define VADHANGOVER       300
+#define VADNOISE          1000
+
+/* Frames on video_in and video_out are raw I420 of VIDEOWIDTH x
+ * VIDEOHEIGHT, both even; calls offer VIDEOBITRATE kbit/s of video,
+ * 0 makes them audio only */
 #define VIDEOWIDTH        1280
 #define VIDEOHEIGHT       720
 #define VIDEOBITRATE      2500
 
+/* Video frames queued between the loop and the audio thread each way */
+#define VIDEOQUEUE        2
+
 static int   friendmsg_log = 1;
 static int   confmsg_log   = 0;
 
 static char *savefile        = ".ratox.tox";
 static int   encryptsavefile = 0;
 
+/* Sends by path that are resumed after a restart */
+static char *resumefile      = ".ratox.resume";
+
+/* Run toxav in a thread of its own, at SCHED_FIFO priority avpriority
+ * unless 0, and with all memory locked into RAM if avlock is set */
+static int avthread   = 0;
+static int avpriority = 0;
+static int avlock     = 0;
+
 static int                 ipv6        = 0;
 static int                 tcp         = 0;
 static int                 proxy       = 0;
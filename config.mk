@@ -8,6 +8,10 @@ MANPREFIX = $(PREFIX)/share/man
 CC = cc
 LD = $(CC)
 CPPFLAGS = -DVERSION=\"${VERSION}\"
+# use select(2) instead of epoll(7) on Linux
+#CPPFLAGS = -DVERSION=\"${VERSION}\" -DUSESELECT
 CFLAGS   = -I/usr/local/include -Wall -Wunused $(CPPFLAGS) -g
+# convert call audio with AVX2 instead of SSE2
+#CFLAGS   = -I/usr/local/include -Wall -Wunused $(CPPFLAGS) -g -mavx2
 LDFLAGS  = -L/usr/local/lib64 -g
 LDLIBS   = -ltoxcore -lsodium -lopus -lvpx -lm -lpthread
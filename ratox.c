@@ -1,15 +1,31 @@
 /* See LICENSE file for copyright and license details. */
+#if defined(__linux__) && !defined(USESELECT)
+#define USEEPOLL
+#endif
+
+#ifdef USEEPOLL
+#include <sys/epoll.h>
+#else
 #include <sys/select.h>
+#endif
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,6 +33,13 @@
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <sodium.h>
 #include <tox/tox.h>
 #include <tox/toxav.h>
 #include <tox/toxencryptsave.h>
@@ -74,12 +97,38 @@ static struct file gfiles[] = {
 
 static int idfd = -1;
 
+/* Maximum number of ready descriptors handled per loop iteration */
+#define MAXEVENTS 64
+
+/* Lossless packet carrying the digest of a sent file: id, file id, digest */
+#define PKTFILEDIGEST 160
+
+enum { WSLOT, WREQUEST, WINVITE, WFRIEND, WTRANSFER, WCONF };
+
+/*
+ * A watch ties a FIFO descriptor to its owner so the event backend
+ * can hand ready descriptors straight back to the code handling them.
+ * `fd' points into the owner, as fiforeset() may replace the descriptor.
+ * Watches on write ends (`out') only fire once the reader went away,
+ * or once the FIFO is writable again if `wr' is set.
+ */
+struct watch {
+	int  *fd;
+	int   type;
+	void *p;
+	int   idx;
+	int   out;
+	int   wr;
+	int   on;
+};
+
 struct slot {
-	const char *name;
-	void      (*cb)(void *);
-	int         outisfolder;
-	int         dirfd;
-	int         fd[LEN(gfiles)];
+	const char  *name;
+	void       (*cb)(void *);
+	int          outisfolder;
+	int          dirfd;
+	int          fd[LEN(gfiles)];
+	struct watch w;
 };
 
 static void setname(void *);
@@ -88,8 +137,9 @@ static void setuserstate(void *);
 static void sendfriendreq(void *);
 static void setnospam(void *);
 static void newconf(void *);
+static void sendbroadcast(void *);
 
-enum { NAME, STATUS, STATE, REQUEST, NOSPAM, CONF };
+enum { NAME, STATUS, STATE, REQUEST, NOSPAM, CONF, BROADCAST };
 
 static struct slot gslots[] = {
 	[NAME]    = { .name = "name",	 .cb = setname,	      .outisfolder = 0, .dirfd = -1, .fd = {-1, -1, -1} },
@@ -98,25 +148,39 @@ static struct slot gslots[] = {
 	[REQUEST] = { .name = "request", .cb = sendfriendreq, .outisfolder = 1, .dirfd = -1, .fd = {-1, -1, -1} },
 	[NOSPAM]  = { .name = "nospam",	 .cb = setnospam,     .outisfolder = 0, .dirfd = -1, .fd = {-1, -1, -1} },
 	[CONF]    = { .name = "conf",    .cb = newconf,       .outisfolder = 1, .dirfd = -1, .fd = {-1, -1, -1} },
+	[BROADCAST] = { .name = "broadcast", .cb = sendbroadcast, .outisfolder = 0, .dirfd = -1, .fd = {-1, -1, -1} },
 };
 
-enum { FTEXT_IN, FFILE_IN, FCALL_IN, FTEXT_OUT, FFILE_OUT, FCALL_OUT,
-       FREMOVE, FONLINE, FNAME, FSTATUS, FSTATE, FFILE_STATE, FCALL_STATE };
+enum { FTEXT_IN, FFILE_PATH, FCALL_IN, FTEXT_OUT, FCALL_OUT,
+       FREMOVE, FONLINE, FNAME, FSTATUS, FSTATE, FCALL_STATE, FCALL_STATS,
+       FVIDEO_IN, FVIDEO_OUT };
 
 static struct file ffiles[] = {
 	[FTEXT_IN]    = { .type = FIFO,	  .name = "text_in",	  .flags = O_RDONLY | O_NONBLOCK	 },
-	[FFILE_IN]    = { .type = FIFO,	  .name = "file_in",	  .flags = O_RDONLY | O_NONBLOCK	 },
+	[FFILE_PATH]  = { .type = FIFO,	  .name = "file_path",	  .flags = O_RDONLY | O_NONBLOCK	 },
 	[FCALL_IN]    = { .type = FIFO,	  .name = "call_in",	  .flags = O_RDONLY | O_NONBLOCK	 },
 	[FTEXT_OUT]   = { .type = STATIC, .name = "text_out",	  .flags = O_WRONLY | O_APPEND | O_CREAT },
-	[FFILE_OUT]   = { .type = FIFO,	  .name = "file_out",	  .flags = O_WRONLY | O_NONBLOCK	 },
 	[FCALL_OUT]   = { .type = FIFO,	  .name = "call_out",	  .flags = O_WRONLY | O_NONBLOCK	 },
 	[FREMOVE]     = { .type = FIFO,	  .name = "remove",	  .flags = O_RDONLY | O_NONBLOCK	 },
 	[FONLINE]     = { .type = STATIC, .name = "online",	  .flags = O_WRONLY | O_TRUNC  | O_CREAT },
 	[FNAME]	      = { .type = STATIC, .name = "name",	  .flags = O_WRONLY | O_TRUNC  | O_CREAT },
 	[FSTATUS]     = { .type = STATIC, .name = "status",	  .flags = O_WRONLY | O_TRUNC  | O_CREAT },
 	[FSTATE]      = { .type = STATIC, .name = "state",	  .flags = O_WRONLY | O_TRUNC  | O_CREAT },
-	[FFILE_STATE] = { .type = STATIC, .name = "file_pending", .flags = O_WRONLY | O_TRUNC  | O_CREAT },
 	[FCALL_STATE] = { .type = STATIC, .name = "call_state",	  .flags = O_WRONLY | O_TRUNC  | O_CREAT },
+	[FCALL_STATS] = { .type = STATIC, .name = "call_stats",	  .flags = O_WRONLY | O_TRUNC  | O_CREAT },
+	[FVIDEO_IN]   = { .type = FIFO,	  .name = "video_in",	  .flags = O_RDONLY | O_NONBLOCK	 },
+	[FVIDEO_OUT]  = { .type = FIFO,	  .name = "video_out",	  .flags = O_WRONLY | O_NONBLOCK	 },
+};
+
+/* Files of each transfer slot, all but the first get a .N suffix */
+enum { TFILE_IN, TFILE_OUT, TFILE_STATE, TFILE_INSTATS, TFILE_OUTSTATS };
+
+static struct file tfiles[] = {
+	[TFILE_IN]       = { .type = FIFO,   .name = "file_in",	       .flags = O_RDONLY | O_NONBLOCK	 },
+	[TFILE_OUT]      = { .type = FIFO,   .name = "file_out",       .flags = O_WRONLY | O_NONBLOCK	 },
+	[TFILE_STATE]    = { .type = STATIC, .name = "file_pending",   .flags = O_WRONLY | O_TRUNC  | O_CREAT },
+	[TFILE_INSTATS]  = { .type = STATIC, .name = "file_in_stats",  .flags = O_WRONLY | O_TRUNC  | O_CREAT },
+	[TFILE_OUTSTATS] = { .type = STATIC, .name = "file_out_stats", .flags = O_WRONLY | O_TRUNC  | O_CREAT },
 };
 
 enum { CMEMBERS, CINVITE, CLEAVE, CTITLE_IN, CTITLE_OUT, CTEXT_IN, CTEXT_OUT };
@@ -137,29 +201,223 @@ static char *ustate[] = {
 	[TOX_USER_STATUS_BUSY]    = "busy"
 };
 
-enum { TRANSFER_NONE, TRANSFER_INITIATED, TRANSFER_PENDING, TRANSFER_INPROGRESS, TRANSFER_PAUSED };
+/*
+ * TRANSFER_FLUSHING: everything was received, file_out still lags behind
+ * TRANSFER_SUSPENDED: the friend went offline, continue once it is back
+ */
+enum { TRANSFER_NONE, TRANSFER_INITIATED, TRANSFER_PENDING, TRANSFER_INPROGRESS, TRANSFER_PAUSED,
+       TRANSFER_FLUSHING, TRANSFER_SUSPENDED };
+
+/* Lines written to a FIFO, kept across reads until their newline */
+struct lines {
+	char  *buf;
+	size_t sz;	/* longest line taken, with its newline */
+	size_t rd;	/* offset of the next line */
+	size_t len;	/* bytes read */
+	int    skip;	/* dropping the rest of a line too long */
+};
+
+/* Byte queue between toxcore and a FIFO */
+struct ring {
+	uint8_t *buf;
+	size_t   sz;
+	size_t   rd;	/* offset of the oldest byte */
+	size_t   len;	/* bytes queued */
+};
+
+/*
+ * A file sent to several friends at once.  It is read once into a
+ * window of SHAREBUFSIZE bytes that starts at the slowest of its
+ * `users' and moves on when the one furthest ahead needs it to.  Those
+ * it leaves more than a window behind read their own chunks.  The
+ * window slides through a buffer twice its size, so the bytes still in
+ * it are only moved back once per window.
+ */
+struct share {
+	int      fd;
+	char    *path;
+	uint8_t  id[TOX_FILE_ID_LENGTH];
+	uint64_t size;
+	uint8_t *buf;
+	size_t   off;	/* offset of the window in buf */
+	uint64_t base;	/* file offset of the window */
+	size_t   len;	/* bytes in the window */
+	int      refs;
+	TAILQ_HEAD(, transfer) users;
+};
+
+/* Counters of a transfer, sampled into its stats file every STATSDELAY ms */
+struct stats {
+	uint64_t bytes;
+	uint64_t chunks;
+	uint64_t pauses;	/* of the sender while file_out lagged */
+	uint64_t retries;	/* chunks toxcore had no room for */
+	uint64_t throttled;	/* chunks held back by the rate caps */
+	uint64_t rate;		/* bytes per second, moving average */
+	uint64_t stalled;	/* ms since bytes last moved */
+	uint64_t mark;		/* bytes at the last sample */
+	uint64_t sampled;	/* mstime() of the last sample */
+};
 
+/* A send or receive slot of a friend with its own file_in or file_out FIFO */
 struct transfer {
+	struct   friend *f;
+	char     tag[20];
+	struct   file fifo;
+	char     fifoname[32];
+	int      fd;
+	struct   file pending;
+	char     pendingname[32];
+	struct   file stats;
+	char     statsname[32];
+	struct   stats st;
+	crypto_generichash_state hs;	/* of the bytes so far, in order */
+	uint64_t hashpos;	/* bytes hashed */
+	int      digeststate;
+	uint8_t  digest[crypto_generichash_BYTES];
+	uint8_t  peerdigest[crypto_generichash_BYTES];	/* the sender's */
+	int      havepeerdigest;
+	struct   watch w;
+	int      filefd;	/* file sent by path or saved to file_dir */
+	struct   share *share;	/* chunks come from it rather than ring */
+	TAILQ_ENTRY(transfer) sentry;
+	char    *path;
+	int      spool;		/* sent from the spool directory */
+	uint8_t  id[TOX_FILE_ID_LENGTH];	/* to resume by */
+	uint64_t size;		/* UINT64_MAX for streams */
+	size_t   unsynced;	/* bytes written since the last sync */
 	uint32_t fnum;
-	uint8_t *buf;
-	ssize_t  n;
-	int      pendingbuf;
+	struct   ring ring;	/* read ahead, or what file_out didn't take */
+	uint64_t pos;		/* next byte to send, or bytes received */
+	uint64_t reqend;	/* end of what toxcore asked for */
+	size_t   reqlen;	/* chunk size toxcore asked for */
+	uint64_t expires;	/* mstime() a suspended receive gives up or send retries */
+	int      eof;
 	int      state;
 };
 
+enum { DIGEST_NONE, DIGEST_RUNNING, DIGEST_DONE };
+
 enum {
 	OUTGOING     = 1 << 0,
 	INCOMING     = 1 << 1,
 	TRANSMITTING = 1 << 2,
 	INCOMPLETE   = 1 << 3,
 	RINGING      = 1 << 4,
+	QUEUED       = 1 << 5,
+};
+
+/* Interleaved PCM of `ms' long frames */
+struct pcmfmt {
+	int      f32;		/* float samples instead of s16 */
+	uint8_t  channels;
+	uint32_t rate;
+	uint32_t ms;
 };
 
+/*
+ * Audio on call_in and call_out is in the format `fmt', toxav gets
+ * `net'.  Received audio waits in the jitter buffer `jb' and is played
+ * into call_out one frame long `tick' at a time.  Playing starts once
+ * the buffer holds the target delay, which follows the measured jitter.
+ */
 struct call {
 	int      state;
-	uint8_t *frame;
+	struct   pcmfmt fmt;
+	struct   pcmfmt net;
+	uint8_t *frame;		/* from callframes */
+	size_t   framelen;	/* bytes of a frame in fmt */
 	ssize_t  n;
-	struct   timespec lastsent;
+	uint64_t ringuntil;	/* mstime() an outgoing call stops ringing */
+	uint64_t nextsend;	/* mstime() the QUEUED frame is due */
+	uint64_t queued;	/* mstime() it was read */
+	float    txcarry[2];	/* last sample sent, for resampling */
+	float    rxcarry[2];	/* last sample received */
+	struct   ring jb;
+	uint8_t *last;		/* last tick played, for concealment */
+	size_t   tick;		/* bytes per tick, 0 without a buffer */
+	size_t   outleft;	/* bytes of last call_out didn't take yet */
+	uint32_t rate;		/* format last received */
+	uint8_t  channels;
+	int      playing;
+	int      missed;	/* ticks in a row without audio */
+	uint64_t nextplay;	/* mstime() of the next tick */
+	uint64_t arrived;	/* mstime() of the last frame received */
+	uint64_t jitter;	/* mean arrival deviation in 1/16 ms */
+	uint64_t underruns;
+	uint64_t overruns;
+	uint32_t bitrate;	/* kbit/s */
+	uint32_t suggested;	/* by toxav since the last adjustment */
+	uint64_t nextrate;	/* mstime() of the next adjustment */
+	uint64_t sendfails;
+	uint64_t failmark;	/* sendfails at the last adjustment */
+	uint64_t late;		/* frames sent a frame behind since then */
+	uint64_t lastvoice;	/* mstime() of the last frame above VADLEVEL */
+	uint64_t nextnoise;	/* mstime() of the next comfort noise */
+	double   noise;		/* mean square of the frames below it */
+	uint64_t frames;
+	uint64_t suppressed;
+	uint8_t *vin;		/* frame being read from video_in */
+	size_t   vinlen;	/* bytes of it read */
+	uint8_t *vout;		/* frame being written to video_out */
+	size_t   voutleft;	/* bytes of it left to write */
+	uint64_t vsent;
+	uint64_t vdropped;	/* frames video_out wasn't ready for */
+	int      vfailing;	/* toxav refuses our frames, warned once */
+	int      vhidden;	/* the friend doesn't accept video */
+};
+
+/*
+ * Token bucket capping file chunks to a rate in bytes per second.
+ * Tokens are kept in thousandths of a byte so that refills every
+ * millisecond don't round down to nothing.
+ */
+struct bucket {
+	uint64_t tokens;
+	uint64_t last;		/* mstime() of the last refill */
+};
+
+/* The longest frame toxav hands out: 120 ms of 48 kHz stereo */
+#define AVMAXSAMPLES (48000 * 120 / 1000 * 2)
+
+/* The longest frame on call_in: 60 ms of 48 kHz stereo f32 */
+#define MAXFRAMELEN  (48000 * 60 / 1000 * 2 * sizeof(float))
+
+/* A raw I420 frame on video_in and video_out: Y, then U and V at half
+ * the width and height */
+#define VIDEOPLANE    (VIDEOWIDTH * VIDEOHEIGHT)
+#define VIDEOFRAMELEN (VIDEOPLANE * 3 / 2)
+
+/* What the audio thread hands the loop besides audio */
+enum { AVAUDIO, AVFAILED, AVBITRATE, AVVIDEO };
+
+struct avframe {
+	int      kind;
+	uint32_t fnum;
+	uint64_t arrived;	/* mstime() of reception */
+	uint32_t rate;		/* or kbit/s for AVBITRATE, the error for AVVIDEO */
+	uint8_t  channels;
+	size_t   len;		/* samples per channel */
+	int16_t  pcm[AVMAXSAMPLES];
+};
+
+struct vframe {
+	uint32_t fnum;
+	int      failing;	/* the loop's vfailing when it was queued */
+	uint8_t  yuv[VIDEOFRAMELEN];
+};
+
+/*
+ * Single-producer single-consumer queue of `n' frames of `size' bytes
+ * between the loop and the audio thread.  Each side only stores its
+ * own index, so neither ever waits for the other.
+ */
+struct avqueue {
+	uint8_t      *buf;
+	size_t        n;
+	size_t        size;
+	atomic_size_t head;	/* next frame to consume */
+	atomic_size_t tail;	/* next frame to produce */
 };
 
 struct friend {
@@ -169,10 +427,18 @@ struct friend {
 	char    idstr[2 * TOX_PUBLIC_KEY_SIZE + 1];
 	int     dirfd;
 	int     fd[LEN(ffiles)];
-	struct  transfer tx;
-	int     rxstate;
+	TOX_CONNECTION conn;
+	struct  transfer tx[MAXTRANSFERS];
+	struct  transfer rx[MAXTRANSFERS];
+	size_t  txnext;
+	struct  bucket bucket;
 	struct  call av;
+	struct  watch w[LEN(ffiles)];
+	int     active;
+	struct  timespec spooltime;	/* mtime of spool when all of it was offered */
+	struct  lines paths;	/* written to file_path */
 	TAILQ_ENTRY(friend) entry;
+	TAILQ_ENTRY(friend) aentry;
 };
 
 struct conference {
@@ -180,6 +446,7 @@ struct conference {
 	char     numstr[2 * sizeof(uint32_t) + 1];
 	int      dirfd;
 	int      fd[LEN(cfiles)];
+	struct   watch w[LEN(cfiles)];
 	TAILQ_ENTRY(conference) entry;
 };
 
@@ -188,6 +455,7 @@ struct request {
 	char    idstr[2 * TOX_PUBLIC_KEY_SIZE + 1];
 	char   *msg;
 	int     fd;
+	struct  watch w;
 	TAILQ_ENTRY(request) entry;
 };
 
@@ -196,40 +464,151 @@ struct invite {
 	uint8_t	*cookie;
 	size_t	 cookielen;
 	uint32_t inviter;
+	uint8_t  id[TOX_PUBLIC_KEY_SIZE];
 	int	 fd;
+	struct	 watch w;
 	TAILQ_ENTRY(invite) entry;
+	LIST_ENTRY(invite) pentry;
+};
+
+/* Everything we know about a public key */
+struct peer {
+	uint8_t         id[TOX_PUBLIC_KEY_SIZE];
+	struct friend  *f;
+	struct request *req;
+	LIST_HEAD(, invite) invs;
+	LIST_ENTRY(peer) entry;
 };
 
 static TAILQ_HEAD(friendhead, friend) friendhead = TAILQ_HEAD_INITIALIZER(friendhead);
+/* Online friends with a transfer or call the loop has to look after */
+static TAILQ_HEAD(activehead, friend) activehead = TAILQ_HEAD_INITIALIZER(activehead);
 static TAILQ_HEAD(confhead, conference) confhead = TAILQ_HEAD_INITIALIZER(confhead);
 static TAILQ_HEAD(reqhead, request) reqhead = TAILQ_HEAD_INITIALIZER(reqhead);
 static TAILQ_HEAD(invhead, invite) invhead = TAILQ_HEAD_INITIALIZER(invhead);
 
+/* Friends and conferences indexed by their tox number */
+static struct friend     **friendtab;
+static size_t              friendtabsz;
+static struct conference **conftab;
+static size_t              conftabsz;
+
+/* Peers hashed by public key */
+static LIST_HEAD(peerhead, peer) *peertab;
+static size_t  peertabsz;
+static size_t  npeers;
+static uint8_t peerkey[crypto_shorthash_KEYBYTES];
+
 static Tox *tox;
 static ToxAV *toxav;
 
-static int    framesize;
+static struct watch **fdwatch;	/* enabled watches indexed by descriptor */
+static size_t         fdwatchsz;
+static struct watch  *evready[MAXEVENTS];
+static struct bucket  filebucket;
+#ifdef USEEPOLL
+static int            epfd = -1;
+#endif
+
+/* Frame buffers handed to calls, which makes MAXCALLS the limit on them */
+static uint8_t        callframes[MAXCALLS][MAXFRAMELEN];
+static struct friend *callowners[MAXCALLS];
+
+/* Audio thread, frames it received and frames for it to send */
+static pthread_t      avtid;
+static atomic_int     avstop;
+static int            avpipe[2] = { -1, -1 };
+static struct avqueue avrx;
+static struct avqueue avtx;
+static struct avqueue vrx;
+static struct avqueue vtx;
+
+/* Lines written to broadcast/in, up to a path for 1024 friends */
+static struct lines   bclines = { .sz = PATH_MAX + 1024 * (2 * TOX_PUBLIC_KEY_SIZE + 1) };
 
 static uint8_t *passphrase;
 static uint32_t pplen;
 
 static volatile sig_atomic_t running = 1;
 
-static struct timespec timediff(struct timespec, struct timespec);
 static void printrat(void);
 static void logmsg(const char *, ...);
 static int fifoopen(int, struct file);
+static void fifomake(int, struct file);
 static void fiforeset(int, int *, struct file);
 static ssize_t fiforead(int, int *, struct file, void *, size_t);
+static ssize_t linesread(struct lines *, int, int *, struct file);
+static int linesready(struct lines *);
+static char *linesnext(struct lines *);
+static void ringinit(struct ring *, size_t);
+static void ringfree(struct ring *);
+static void ringput(struct ring *, const uint8_t *, size_t);
+static int ringwrite(struct ring *, int);
+static int ringpwrite(struct ring *, int, off_t);
+static ssize_t ringread(struct ring *, int);
+static uint8_t *ringpeek(struct ring *, uint8_t *, size_t);
+static void ringdrop(struct ring *, size_t);
+static void avqinit(struct avqueue *, size_t, size_t);
+static void *avqreserve(struct avqueue *);
+static void avqpush(struct avqueue *);
+static void *avqfront(struct avqueue *);
+static void avqpop(struct avqueue *);
+static size_t pcmsize(const struct pcmfmt *);
+static void s16tof32(float *, const int16_t *, size_t);
+static void f32tos16(int16_t *, const float *, size_t);
+static uint64_t sumsq(const int16_t *, size_t);
+static void pcmmix(float *, const float *, size_t, int, int);
+static void pcmresample(float *, size_t, const float *, size_t, int, float *);
+static size_t pcmconv(void *, const struct pcmfmt *, const void *, const struct pcmfmt *, size_t, float *);
 static uint32_t interval(Tox *, struct ToxAV*);
+static void *tabgrow(void *, size_t *, size_t);
+static void evinit(void);
+static void evadd(struct watch *);
+static void evdel(struct watch *);
+static void evmod(struct watch *);
+static int evwait(int);
+static void watchinit(struct watch *, int *, int, void *, int);
+static void watchon(struct watch *, int);
+static void watchwrite(struct watch *, int);
+static void watchclose(struct watch *);
+static uint64_t mstime(void);
+static void friendwatch(struct friend *);
 
 static void cbcallinvite(ToxAV *, uint32_t, bool, bool, void *);
 static void cbcallstate(ToxAV *, uint32_t, uint32_t, void *);
 static void cbcalldata(ToxAV *, uint32_t, const int16_t *, size_t, uint8_t, uint32_t, void *);
+static void cbcallbitrate(ToxAV *, uint32_t, uint32_t, void *);
+static void callbitrate(struct friend *, uint32_t);
+static void setbitrate(struct friend *, uint32_t);
+static void ratecall(struct friend *);
+static void callrecv(struct friend *, const int16_t *, size_t, uint8_t, uint32_t, uint64_t);
+static void cbvideodata(ToxAV *, uint32_t, uint16_t, uint16_t, const uint8_t *,
+                        const uint8_t *, const uint8_t *, int32_t, int32_t, int32_t, void *);
+static void planescale(uint8_t *, size_t, size_t, const uint8_t *, size_t, size_t, int32_t);
+static void videoscale(uint8_t *, uint16_t, uint16_t, const uint8_t *, const uint8_t *,
+                       const uint8_t *, int32_t, int32_t, int32_t);
+static uint8_t *videobuf(struct friend *);
+static void flushvideo(struct friend *);
+static void avdrain(void);
+static int onavthread(void);
+static void avreport(int, uint32_t, uint32_t);
 
 static void cleanupcall(struct friend *);
 static void cancelcall(struct friend *, char *);
+static int callalloc(struct friend *);
+static void callfree(struct friend *);
+static int callsetup(struct friend *);
+static void jbreset(struct friend *);
+static void jbfree(struct friend *);
+static uint32_t playcall(struct friend *);
+static int writecall(struct friend *);
+static void writecallstats(struct friend *);
 static void sendfriendcalldata(struct friend *);
+static uint32_t sendcall(struct friend *);
+static int vadsend(struct friend *, int16_t *, size_t, uint64_t);
+static void sendfriendvideo(struct friend *);
+static TOXAV_ERR_SEND_FRAME sendvideo(uint32_t, const uint8_t *);
+static void videoresult(struct friend *, TOXAV_ERR_SEND_FRAME);
 static void writemembers(struct conference *);
 
 static void cbconnstatus(Tox *, uint32_t, TOX_CONNECTION, void *);
@@ -241,17 +620,55 @@ static void cbfriendstate(Tox *, uint32_t, TOX_USER_STATUS, void *);
 static void cbfilecontrol(Tox *, uint32_t, uint32_t, TOX_FILE_CONTROL, void *);
 static void cbfilesendreq(Tox *, uint32_t, uint32_t, uint32_t, uint64_t, const uint8_t *, size_t, void *);
 static void cbfiledata(Tox *, uint32_t, uint32_t, uint64_t, const uint8_t *, size_t, void *);
+static void cbfiledigest(Tox *, uint32_t, const uint8_t *, size_t, void *);
+static void digestupdate(struct transfer *, uint64_t, const uint8_t *, size_t);
+static void digestfinal(struct transfer *);
+static void digestcheck(struct transfer *);
+static void senddigest(struct transfer *);
+static void flushrxtransfer(struct transfer *);
+static void throttlerxtransfer(struct transfer *);
+static int savefriendfile(struct transfer *, const char *);
+static int storerxtransfer(struct transfer *);
+static void syncrxtransfer(struct transfer *);
+static void statsreset(struct transfer *);
+static void statswrite(struct transfer *);
 
 static void cbconfinvite(Tox *, uint32_t, TOX_CONFERENCE_TYPE, const uint8_t *, size_t, void *);
 static void cbconfmessage(Tox *, uint32_t, uint32_t, TOX_MESSAGE_TYPE, const uint8_t *, size_t, void *);
 static void cbconftitle(Tox *, uint32_t, uint32_t, const uint8_t *, size_t, void *);
 static void cbconfmembers(Tox *, uint32_t, void *);
 
-static void canceltxtransfer(struct friend *);
-static void cancelrxtransfer(struct friend *);
+static void endtxtransfer(struct transfer *);
+static void endrxtransfer(struct transfer *);
+static void canceltxtransfer(struct transfer *);
+static void cancelrxtransfer(struct transfer *);
+static void canceltransfers(struct friend *);
+static void suspendtransfers(struct friend *);
+static void resumetransfers(struct friend *);
+static void expiretransfers(struct friend *);
+static void resumetxtransfer(struct transfer *);
 static void sendfriendtext(struct friend *);
+static void sendfriendfile(struct transfer *);
+static void sendfriendpath(struct friend *);
+static void offerpaths(struct friend *);
+static int offerfile(struct friend *, char *, uint8_t *);
+static int openregular(char *, struct stat *);
+static void spoolfriend(struct friend *);
+static void spooldone(struct transfer *);
+static struct share *shareopen(char *);
+static void shareput(struct share *);
+static uint8_t *sharepeek(struct share *, uint64_t, size_t, uint8_t *);
+static int offershare(struct friend *, struct share *);
+static void readfriendfile(struct transfer *);
+static int filetokens(struct friend *, size_t);
+static int sendfilechunk(struct transfer *);
+static void sendfriendfiledata(struct friend *);
+static void callfriend(struct friend *);
 static void removefriend(struct friend *);
+static void answerrequest(struct request *);
+static void answerinvite(struct invite *);
 static void invitefriend(struct conference *);
+static void leaveconf(struct conference *);
 static void sendconftext(struct conference *);
 static void updatetitle(struct conference *);
 static int readpass(const char *, uint8_t **, uint32_t *);
@@ -260,44 +677,37 @@ static void dataload(struct Tox_Options *);
 static void datasave(void);
 static int localinit(void);
 static int toxinit(void);
+static void *avloop(void *);
+static void avinit(void);
+static void avshutdown(void);
 static int toxconnect(void);
 static void id2str(uint8_t *, char *);
 static void str2id(char *, uint8_t *);
+static void peerinit(void);
+static struct peer *peerget(const uint8_t *, int);
+static void peerput(struct peer *);
+static struct friend *friendget(uint32_t);
+static struct conference *confget(uint32_t);
+static struct transfer *transferget(struct transfer *, uint32_t);
+static void transferinit(struct friend *, struct transfer *, int, size_t);
+static void transferdestroy(struct transfer *);
 static void friendcreate(uint32_t);
 static void confcreate(uint32_t);
 static void friendload(void);
+static void resumeload(void);
+static void resumesave(void);
 static void frienddestroy(struct friend *);
 static void confdestroy(struct conference *);
+static void requestdestroy(struct request *);
+static void invitedestroy(struct invite *);
 static void loop(void);
 static void initshutdown(int);
 static void toxshutdown(void);
 static void usage(void);
 
-#define FD_APPEND(fd) do {	\
-	FD_SET((fd), &rfds);	\
-	if ((fd) > fdmax)	\
-		fdmax = (fd);	\
-} while (0)
-
 #undef MIN
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
-
-static struct timespec
-timediff(struct timespec t1, struct timespec t2)
-{
-	struct timespec tmp;
-
-	tmp.tv_sec = t2.tv_sec - t1.tv_sec;
-
-	if ((t2.tv_nsec - t1.tv_nsec) > 0) {
-		tmp.tv_nsec = (t2.tv_nsec - t1.tv_nsec);
-	} else {
-		tmp.tv_nsec = 1E9 - (t1.tv_nsec - t2.tv_nsec);
-		tmp.tv_sec--;
-	}
-
-	return tmp;
-}
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
 
 static void
 printrat(void)
@@ -346,20 +756,35 @@ fifoopen(int dirfd, struct file f)
 	return fd;
 }
 
+/* Replace the FIFO with a fresh one without opening it */
 static void
-fiforeset(int dirfd, int *fd, struct file f)
+fifomake(int dirfd, struct file f)
 {
 	ssize_t r;
 
 	r = unlinkat(dirfd, f.name, 0);
 	if (r < 0 && errno != ENOENT)
 		eprintf("unlinkat %s:", f.name);
-	if (*fd != -1)
-		close(*fd);
 	r = mkfifoat(dirfd, f.name, 0666);
 	if (r < 0 && errno != EEXIST)
 		eprintf("mkfifoat %s:", f.name);
+}
+
+static void
+fiforeset(int dirfd, int *fd, struct file f)
+{
+	struct  watch *w = NULL;
+
+	if (*fd != -1) {
+		/* carry an enabled watch over to the new descriptor */
+		if (*fd < fdwatchsz && (w = fdwatch[*fd]))
+			evdel(w);
+		close(*fd);
+	}
+	fifomake(dirfd, f);
 	*fd = fifoopen(dirfd, f);
+	if (w)
+		evadd(w);
 }
 
 static ssize_t
@@ -382,726 +807,3157 @@ again:
 	return r;
 }
 
-static uint32_t
-interval(Tox *m, struct ToxAV *av)
+/*
+ * Read more of a FIFO into `l'.  The writer closing ends its last
+ * line.  Returns -1 if there was nothing to read.
+ */
+static ssize_t
+linesread(struct lines *l, int dirfd, int *fd, struct file f)
 {
-	return MIN(tox_iteration_interval(m), toxav_iteration_interval(av));
+	ssize_t n;
+
+	if (!l->buf && !(l->buf = malloc(l->sz)))
+		eprintf("malloc:");
+	memmove(l->buf, l->buf + l->rd, l->len - l->rd);
+	l->len -= l->rd;
+	l->rd = 0;
+	if (l->len == l->sz) {
+		if (!l->skip)
+			weprintf("%s: Line too long\n", f.name);
+		l->skip = 1;
+		l->len = 0;
+	}
+
+	n = fiforead(dirfd, fd, f, l->buf + l->len, l->sz - l->len);
+	if (n < 0)
+		return -1;
+	if (n > 0)
+		l->len += n;
+	else if (l->len > 0 && !l->skip)
+		l->buf[l->len++] = '\n';
+	else
+		l->len = l->skip = 0;
+	return n;
 }
 
-static void
-cbcallinvite(ToxAV *av, uint32_t fnum, bool audio, bool video, void *udata)
+/* Whether a whole line waits in `l' */
+static int
+linesready(struct lines *l)
 {
-	struct  friend *f;
-
-	TAILQ_FOREACH(f, &friendhead, entry)
-		if (f->num == fnum)
-			break;
-	if (!f)
-		return;
+	return l->buf && memchr(l->buf + l->rd, '\n', l->len - l->rd);
+}
 
-	if (!audio) {
-		if (!toxav_call_control(toxav, f->num, TOXAV_CALL_CONTROL_CANCEL, NULL))
-			weprintf("Failed to reject call\n");
-		logmsg(": %s : Audio > Rejected (no audio)\n", f->name);
-		return;
+/* The next whole line read into `l', or NULL */
+static char *
+linesnext(struct lines *l)
+{
+	char *line, *end;
+
+	while ((end = memchr(l->buf + l->rd, '\n', l->len - l->rd))) {
+		line = l->buf + l->rd;
+		*end = '\0';
+		l->rd = end + 1 - l->buf;
+		if (!l->skip)
+			return line;
+		l->skip = 0;
 	}
-
-	f->av.state |= RINGING;
-	ftruncate(f->fd[FCALL_STATE], 0);
-	lseek(f->fd[FCALL_STATE], 0, SEEK_SET);
-	dprintf(f->fd[FCALL_STATE], "pending\n");
-
-	logmsg(": %s : Audio > Ringing\n", f->name);
+	if (l->skip)
+		l->rd = l->len;
+	return NULL;
 }
 
 static void
-cbcallstate(ToxAV *av, uint32_t fnum, uint32_t state, void *udata)
+ringinit(struct ring *r, size_t sz)
 {
-	struct friend *f;
-
-	TAILQ_FOREACH(f, &friendhead, entry)
-		if (f->num == fnum)
-			break;
-	if (!f)
-		return;
-
-	if ((state & TOXAV_FRIEND_CALL_STATE_ERROR)
-	    || (state & TOXAV_FRIEND_CALL_STATE_FINISHED)) {
-		f->av.state &= ~TRANSMITTING;
-		logmsg(": %s : Audio > Finished\n", f->name);
-		cleanupcall(f);
-		return;
-	}
+	r->buf = malloc(sz);
+	if (!r->buf)
+		eprintf("malloc:");
+	r->sz = sz;
+	r->rd = 0;
+	r->len = 0;
+}
 
-	/*
-	 * If we've are ringing a friend, and he sends a control that's
-	 * not FINISHED, it means he accepted the call, so we can start
-	 * transmitting audio frames
-	 */
-	if (f->av.state & RINGING) {
-		f->av.state &= ~RINGING;
-		f->av.state |= TRANSMITTING;
-		logmsg(": %s : Audio > Transmitting\n", f->name);
-	}
+static void
+ringfree(struct ring *r)
+{
+	free(r->buf);
+	r->buf = NULL;
+	r->sz = 0;
+	r->rd = 0;
+	r->len = 0;
 }
 
+/* Queue `len' bytes, growing the ring if they don't fit */
 static void
-cbcalldata(ToxAV *av, uint32_t fnum, const int16_t *data, size_t len,
-           uint8_t channels, uint32_t rate, void *udata)
+ringput(struct ring *r, const uint8_t *data, size_t len)
 {
-	struct   friend *f;
-	ssize_t  n, wrote;
-	int      fd;
 	uint8_t *buf;
+	size_t   sz, off, n;
 
-	TAILQ_FOREACH(f, &friendhead, entry)
-		if (f->num == fnum)
-			break;
-	if (!f)
+	if (!len)
 		return;
-	if (!(f->av.state & INCOMING)) {
-		/* try to open call_out for writing */
-		fd = fifoopen(f->dirfd, ffiles[FCALL_OUT]);
-		if (fd < 0) {
-			close (fd);
-			return;
-		}
-		if (f->fd[FCALL_OUT] < 0) {
-			f->fd[FCALL_OUT] = fd;
-			f->av.state |= INCOMING;
-		}
+	if (r->len + len > r->sz) {
+		for (sz = r->sz ? r->sz : len; sz < r->len + len; sz *= 2)
+			;
+		buf = malloc(sz);
+		if (!buf)
+			eprintf("malloc:");
+		n = MIN(r->len, r->sz - r->rd);
+		memcpy(buf, r->buf + r->rd, n);
+		memcpy(buf + n, r->buf, r->len - n);
+		free(r->buf);
+		r->buf = buf;
+		r->sz = sz;
+		r->rd = 0;
 	}
+	off = (r->rd + r->len) % r->sz;
+	n = MIN(len, r->sz - off);
+	memcpy(r->buf + off, data, n);
+	memcpy(r->buf, data + n, len - n);
+	r->len += len;
+}
 
-	buf = (uint8_t *)data;
-	len *= 2;
-	wrote = 0;
-	while (len > 0) {
-		n = write(f->fd[FCALL_OUT], &buf[wrote], len);
+/* Write out as much as `fd' takes without blocking, -1 on error */
+static int
+ringwrite(struct ring *r, int fd)
+{
+	struct iovec iov[2];
+	ssize_t n;
+
+	while (r->len > 0) {
+		iov[0].iov_base = r->buf + r->rd;
+		iov[0].iov_len = MIN(r->len, r->sz - r->rd);
+		iov[1].iov_base = r->buf;
+		iov[1].iov_len = r->len - iov[0].iov_len;
+		n = writev(fd, iov, iov[1].iov_len ? 2 : 1);
 		if (n < 0) {
-			if (errno == EPIPE)
-				f->av.state &= ~INCOMING;
-			break;
-		} else if (n == 0) {
-			break;
+			if (errno == EINTR)
+				continue;
+			if (errno == EWOULDBLOCK)
+				break;
+			return -1;
 		}
-		wrote += n;
-		len -= n;
+		r->rd = (r->rd + n) % r->sz;
+		r->len -= n;
 	}
+	if (!r->len)
+		r->rd = 0;
+	return 0;
 }
 
-static void
-cbconfinvite(Tox *m, uint32_t frnum, TOX_CONFERENCE_TYPE type, const uint8_t *cookie, size_t clen, void * udata)
+/* Write out everything queued at offset `off' of `fd', -1 on error */
+static int
+ringpwrite(struct ring *r, int fd, off_t off)
 {
-	size_t i, j, namelen;
-	struct file invfifo;
-	struct invite *inv;
-	uint8_t id[TOX_PUBLIC_KEY_SIZE];
-
-	if(type != TOX_CONFERENCE_TYPE_TEXT) {
-		weprintf("Only text conferences supported at the moment\n");
-		return;
-	}
+	ssize_t n;
 
-	if (!tox_friend_get_public_key(tox, frnum, id, NULL)) {
-		weprintf("Failed to get key by friend %i for invite\n", frnum);
-		return;
+	while (r->len > 0) {
+		n = pwrite(fd, r->buf + r->rd, MIN(r->len, r->sz - r->rd), off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		off += n;
+		ringdrop(r, n);
 	}
+	return 0;
+}
 
-	inv = calloc(1, sizeof(*inv));
-	if (!inv)
-		eprintf("calloc:");
-	inv->fd = -1;
+/* Fill the free space of the ring from `fd', returns like read(2) */
+static ssize_t
+ringread(struct ring *r, int fd)
+{
+	struct iovec iov[2];
+	size_t  off;
+	ssize_t n;
 
-	inv->inviter = frnum;
-	inv->cookielen = clen;
-	inv->cookie = malloc(inv->cookielen);
-	if (!inv->cookie)
-		eprintf("malloc:");
+	if (r->len == r->sz) {
+		errno = EWOULDBLOCK;
+		return -1;
+	}
+	off = (r->rd + r->len) % r->sz;
+	iov[0].iov_base = r->buf + off;
+	iov[0].iov_len = MIN(r->sz - r->len, r->sz - off);
+	iov[1].iov_base = r->buf;
+	iov[1].iov_len = r->sz - r->len - iov[0].iov_len;
+	do
+		n = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+	while (n < 0 && errno == EINTR);
+	if (n > 0)
+		r->len += n;
+	return n;
+}
 
-	memcpy(inv->cookie, cookie, clen);
+/* The `n' oldest bytes, copied to `tmp' if they wrap around */
+static uint8_t *
+ringpeek(struct ring *r, uint8_t *tmp, size_t n)
+{
+	size_t m;
 
-	namelen = 2 * TOX_PUBLIC_KEY_SIZE + 1 + 2 * clen + 2;
-	inv->fifoname = malloc(namelen);
-	if (!inv->fifoname)
-		eprintf("malloc:");
+	m = r->sz - r->rd;
+	if (n <= m)
+		return r->buf + r->rd;
+	memcpy(tmp, r->buf + r->rd, m);
+	memcpy(tmp + m, r->buf, n - m);
+	return tmp;
+}
 
-	i = 0;
-	id2str(id, inv->fifoname);
-	i += 2 * TOX_PUBLIC_KEY_SIZE;
-	inv->fifoname[i] = '_';
-	i++;
-	for(j = 0; j < clen; i+=2, j++)
-		sprintf(inv->fifoname + i, "%02X", cookie[j]);
-	i++;
-	inv->fifoname[i] = '\0';
+static void
+ringdrop(struct ring *r, size_t n)
+{
+	if (!n)
+		return;
+	r->rd = (r->rd + n) % r->sz;
+	r->len -= n;
+	if (!r->len)
+		r->rd = 0;
+}
 
-	invfifo.name = inv->fifoname;
-	invfifo.flags = O_RDONLY | O_NONBLOCK;
-	fiforeset(gslots[CONF].fd[OUT], &inv->fd, invfifo);
+static void
+avqinit(struct avqueue *q, size_t n, size_t size)
+{
+	q->buf = calloc(n, size);
+	if (!q->buf)
+		eprintf("calloc:");
+	q->n = n;
+	q->size = size;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+}
 
-	TAILQ_INSERT_TAIL(&invhead, inv, entry);
+/* Returns the frame to fill in, or NULL if the consumer is behind */
+static void *
+avqreserve(struct avqueue *q)
+{
+	size_t tail;
 
-	logmsg("Invite > %s\n", inv->fifoname);
+	tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&q->head, memory_order_acquire) == q->n)
+		return NULL;
+	return q->buf + tail % q->n * q->size;
 }
 
 static void
-cbconfmessage(Tox *m, uint32_t cnum, uint32_t pnum, TOX_MESSAGE_TYPE type, const uint8_t *data, size_t len, void *udata)
+avqpush(struct avqueue *q)
 {
-	struct  conference *c;
-	time_t  t;
-	uint8_t msg[len + 1], namt[TOX_MAX_NAME_LENGTH + 1];
-	char    buft[64];
+	atomic_fetch_add_explicit(&q->tail, 1, memory_order_release);
+}
 
-	memcpy(msg, data, len);
-	msg[len] = '\0';
+static void *
+avqfront(struct avqueue *q)
+{
+	size_t head;
 
-	TAILQ_FOREACH(c, &confhead, entry) {
-		if (c->num == cnum) {
-			t = time(NULL);
-			strftime(buft, sizeof(buft), "%F %R", localtime(&t));
-			if (!tox_conference_peer_get_name(tox, c->num, pnum, namt, NULL)) {
-				weprintf("Unable to obtain name for peer %d in conference %s\n", pnum, c->numstr);
-				return;
-			}
-			namt[tox_conference_peer_get_name_size(tox, c->num, pnum, NULL)] = '\0';
-			dprintf(c->fd[CTEXT_OUT], "%s <%s> %s\n", buft, namt, msg);
-			if (confmsg_log)
-				logmsg("%s : %s <%s> %s\n", c->numstr, buft, namt, msg);
-			break;
-		}
-	}
+	head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	if (head == atomic_load_explicit(&q->tail, memory_order_acquire))
+		return NULL;
+	return q->buf + head % q->n * q->size;
 }
 
 static void
-cbconftitle(Tox *m, uint32_t cnum, uint32_t pnum, const uint8_t *data, size_t len, void * udata)
+avqpop(struct avqueue *q)
 {
-	struct  conference *c;
-	char    title[TOX_MAX_NAME_LENGTH + 1];
+	atomic_fetch_add_explicit(&q->head, 1, memory_order_release);
+}
 
-	memcpy(title, data, len);
-	title[len] = '\0';
+/* Bytes per sample frame, all channels */
+static size_t
+pcmsize(const struct pcmfmt *fmt)
+{
+	return fmt->channels * (fmt->f32 ? sizeof(float) : sizeof(int16_t));
+}
 
-	TAILQ_FOREACH(c, &confhead, entry) {
-		if (c->num == cnum) {
-			ftruncate(c->fd[CTITLE_OUT], 0);
-			lseek(c->fd[CTITLE_OUT], 0, SEEK_SET);
-			dprintf(c->fd[CTITLE_OUT], "%s\n", title);
-			logmsg(": %s : Title > %s\n", c->numstr, title);
-			break;
-		}
+static void
+s16tof32(float *dst, const int16_t *src, size_t n)
+{
+	size_t i = 0;
+#if defined(__AVX2__)
+	__m256  k = _mm256_set1_ps(1.0f / 32768);
+	__m256i v;
+
+	for (; i + 16 <= n; i += 16) {
+		v = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(k, _mm256_cvtepi32_ps(
+		                 _mm256_cvtepi16_epi32(_mm256_castsi256_si128(v)))));
+		_mm256_storeu_ps(dst + i + 8, _mm256_mul_ps(k, _mm256_cvtepi32_ps(
+		                 _mm256_cvtepi16_epi32(_mm256_extracti128_si256(v, 1)))));
+	}
+#elif defined(__SSE2__)
+	__m128  k = _mm_set1_ps(1.0f / 32768);
+	__m128i v;
+
+	for (; i + 8 <= n; i += 8) {
+		/* sign extend by shifting each sample down from the top half */
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_ps(dst + i, _mm_mul_ps(k, _mm_cvtepi32_ps(
+		              _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16))));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(k, _mm_cvtepi32_ps(
+		              _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16))));
 	}
+#endif
+	for (; i < n; i++)
+		dst[i] = src[i] / 32768.0f;
 }
 
+/* Clips to [-1, 1] first, the packs would wrap huge values around */
 static void
-cbconfmembers(Tox *m, uint32_t cnum, void *udata)
+f32tos16(int16_t *dst, const float *src, size_t n)
 {
-	struct  conference *c;
+	size_t i = 0;
+	float  x;
+#if defined(__AVX2__)
+	__m256  k = _mm256_set1_ps(32768), lo = _mm256_set1_ps(-1), hi = _mm256_set1_ps(1);
+	__m256i a, b;
+
+	for (; i + 16 <= n; i += 16) {
+		a = _mm256_cvtps_epi32(_mm256_mul_ps(k, _mm256_min_ps(hi,
+		    _mm256_max_ps(lo, _mm256_loadu_ps(src + i)))));
+		b = _mm256_cvtps_epi32(_mm256_mul_ps(k, _mm256_min_ps(hi,
+		    _mm256_max_ps(lo, _mm256_loadu_ps(src + i + 8)))));
+		/* the pack works within 128-bit lanes, put them back in order */
+		_mm256_storeu_si256((__m256i *)(dst + i),
+		                    _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8));
+	}
+#elif defined(__SSE2__)
+	__m128  k = _mm_set1_ps(32768), lo = _mm_set1_ps(-1), hi = _mm_set1_ps(1);
+	__m128i a, b;
+
+	for (; i + 8 <= n; i += 8) {
+		a = _mm_cvtps_epi32(_mm_mul_ps(k, _mm_min_ps(hi,
+		    _mm_max_ps(lo, _mm_loadu_ps(src + i)))));
+		b = _mm_cvtps_epi32(_mm_mul_ps(k, _mm_min_ps(hi,
+		    _mm_max_ps(lo, _mm_loadu_ps(src + i + 4)))));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+	}
+#endif
+	for (; i < n; i++) {
+		x = MIN(MAX(src[i], -1.0f), 1.0f);
+		dst[i] = MIN(lrintf(x * 32768), INT16_MAX);
+	}
+}
 
-	TAILQ_FOREACH(c, &confhead, entry) {
-		if (c->num == cnum) {
-			writemembers(c);
-			break;
-		}
+/* Sum of the squared samples, for the energy of a frame */
+static uint64_t
+sumsq(const int16_t *s, size_t n)
+{
+	uint64_t sum = 0;
+	size_t   i = 0;
+#if defined(__AVX2__)
+	__m256i  v, acc = _mm256_setzero_si256(), z = _mm256_setzero_si256();
+	uint64_t lane[4];
+
+	/* pairs of squares reach 1 << 31, widen them before adding up */
+	for (; i + 16 <= n; i += 16) {
+		v = _mm256_loadu_si256((const __m256i *)(s + i));
+		v = _mm256_madd_epi16(v, v);
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, z));
+		acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, z));
+	}
+	_mm256_storeu_si256((__m256i *)lane, acc);
+	sum = lane[0] + lane[1] + lane[2] + lane[3];
+#elif defined(__SSE2__)
+	__m128i  v, acc = _mm_setzero_si128(), z = _mm_setzero_si128();
+	uint64_t lane[2];
+
+	/* pairs of squares reach 1 << 31, widen them before adding up */
+	for (; i + 8 <= n; i += 8) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		v = _mm_madd_epi16(v, v);
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, z));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, z));
 	}
+	_mm_storeu_si128((__m128i *)lane, acc);
+	sum = lane[0] + lane[1];
+#endif
+	for (; i < n; i++)
+		sum += s[i] * s[i];
+	return sum;
 }
 
+/* Mixes n sample frames of stereo down to mono or mono up to stereo */
 static void
-cleanupcall(struct friend *f)
+pcmmix(float *dst, const float *src, size_t n, int ich, int och)
 {
-	f->av.state = 0;
+	size_t i;
+
+	if (och == 1)
+		for (i = 0; i < n; i++)
+			dst[i] = (src[2 * i] + src[2 * i + 1]) / 2;
+	else
+		for (i = 0; i < n; i++)
+			dst[2 * i] = dst[2 * i + 1] = src[i];
+}
+
+/*
+ * Linearly interpolates n sample frames into m.  The last frame of the
+ * previous call is kept in `carry' and interpolated from, so that the
+ * frame edges don't click.
+ */
+static void
+pcmresample(float *dst, size_t m, const float *src, size_t n, int ch, float *carry)
+{
+	double t;
+	float  a, b, w;
+	long   k;
+	size_t j;
+	int    c;
+
+	for (j = 0; j < m; j++) {
+		t = (double)(j + 1) * n / m - 1;
+		k = floor(t);
+		w = t - k;
+		for (c = 0; c < ch; c++) {
+			a = k < 0 ? carry[c] : src[k * ch + c];
+			b = k + 1 < (long)n ? src[(k + 1) * ch + c] : a;
+			dst[j * ch + c] = a + (b - a) * w;
+		}
+	}
+	memcpy(carry, src + (n - 1) * ch, ch * sizeof(float));
+}
+
+/*
+ * Converts n sample frames from one format into another, with up to
+ * AVMAXSAMPLES samples on either side.  Returns the sample frames
+ * written to dst.
+ */
+static size_t
+pcmconv(void *dst, const struct pcmfmt *to, const void *src,
+        const struct pcmfmt *from, size_t n, float *carry)
+{
+	static float a[AVMAXSAMPLES], b[AVMAXSAMPLES];
+	const float *p;
+	float *q;
+	size_t m;
+
+	m = (uint64_t)n * to->rate / from->rate;
+	if (!n)
+		return 0;
+	if (from->f32 == to->f32 && from->channels == to->channels && m == n) {
+		memcpy(dst, src, n * pcmsize(from));
+		return n;
+	}
+
+	/* work in floats, each step from one scratch buffer into the other */
+	if (from->f32) {
+		p = src;
+	} else {
+		s16tof32(a, src, n * from->channels);
+		p = a;
+	}
+	if (from->channels != to->channels) {
+		q = p == a ? b : a;
+		pcmmix(q, p, n, from->channels, to->channels);
+		p = q;
+	}
+	if (m != n) {
+		q = p == a ? b : a;
+		pcmresample(q, m, p, n, to->channels, carry);
+		p = q;
+	}
+	if (to->f32)
+		memcpy(dst, p, m * pcmsize(to));
+	else
+		f32tos16(dst, p, m * to->channels);
+	return m;
+}
+
+static uint32_t
+interval(Tox *m, struct ToxAV *av)
+{
+	if (avthread)
+		return tox_iteration_interval(m);
+	return MIN(tox_iteration_interval(m), toxav_iteration_interval(av));
+}
+
+/* Grow a table of pointers so that `i' is a valid index */
+static void *
+tabgrow(void *tab, size_t *sz, size_t i)
+{
+	size_t n;
+
+	if (i < *sz)
+		return tab;
+	for (n = *sz ? *sz : 64; n <= i; n *= 2)
+		;
+	tab = realloc(tab, n * sizeof(void *));
+	if (!tab)
+		eprintf("realloc:");
+	memset((void **)tab + *sz, 0, (n - *sz) * sizeof(void *));
+	*sz = n;
+	return tab;
+}
+
+static void
+evinit(void)
+{
+#ifdef USEEPOLL
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		eprintf("epoll_create1:");
+#endif
+}
+
+static void
+evadd(struct watch *w)
+{
+	int fd = *w->fd;
+#ifdef USEEPOLL
+	struct epoll_event ev;
+#endif
+
+	if (fd < 0)
+		return;
+#ifdef USEEPOLL
+	/* EPOLLERR is always reported */
+	ev.events = w->out ? (w->wr ? EPOLLOUT : 0) : EPOLLIN;
+	ev.data.ptr = w;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		eprintf("epoll_ctl:");
+#else
+	if (fd >= FD_SETSIZE) {
+		weprintf("Descriptor %d exceeds FD_SETSIZE, not watching it\n", fd);
+		return;
+	}
+#endif
+	fdwatch = tabgrow(fdwatch, &fdwatchsz, fd);
+	fdwatch[fd] = w;
+}
+
+static void
+evdel(struct watch *w)
+{
+	int fd = *w->fd;
+
+	if (fd < 0 || fd >= fdwatchsz || fdwatch[fd] != w)
+		return;
+#ifdef USEEPOLL
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) < 0)
+		eprintf("epoll_ctl:");
+#endif
+	fdwatch[fd] = NULL;
+}
+
+/* Pick up a changed `wr' on an enabled watch */
+static void
+evmod(struct watch *w)
+{
+#ifdef USEEPOLL
+	struct epoll_event ev;
+	int    fd = *w->fd;
+
+	if (fd < 0 || fd >= fdwatchsz || fdwatch[fd] != w)
+		return;
+	ev.events = w->wr ? EPOLLOUT : 0;
+	ev.data.ptr = w;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+		eprintf("epoll_ctl:");
+#endif
+}
+
+/* Call audio is handled first, then text, then everything else */
+static int
+watchprio(struct watch *w)
+{
+	if (w->type == WFRIEND && w->idx == FCALL_IN)
+		return 0;
+	if ((w->type == WFRIEND && w->idx == FTEXT_IN) ||
+	    (w->type == WCONF && w->idx == CTEXT_IN))
+		return 1;
+	return 2;
+}
+
+static void
+evsort(int n)
+{
+	struct watch *tmp[MAXEVENTS];
+	int    i, j, prio;
+
+	if (n < 2)
+		return;
+	for (j = 0, prio = 0; prio < 3; prio++)
+		for (i = 0; i < n; i++)
+			if (watchprio(evready[i]) == prio)
+				tmp[j++] = evready[i];
+	memcpy(evready, tmp, n * sizeof(*evready));
+}
+
+/* Wait for ready watches and store them in evready, most urgent first */
+static int
+evwait(int ms)
+{
+#ifdef USEEPOLL
+	struct epoll_event evs[MAXEVENTS];
+	int    i, n;
+
+	n = epoll_wait(epfd, evs, LEN(evs), ms);
+	for (i = 0; i < n; i++)
+		evready[i] = evs[i].data.ptr;
+	evsort(n);
+	return n;
+#else
+	struct timeval tv;
+	struct pollfd pfd;
+	fd_set rfds, wfds;
+	int    fd, fdmax = -1, n;
+
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	for (fd = 0; fd < fdwatchsz; fd++) {
+		if (!fdwatch[fd])
+			continue;
+		if (!fdwatch[fd]->out)
+			FD_SET(fd, &rfds);
+		else if (fdwatch[fd]->wr)
+			FD_SET(fd, &wfds);
+		else
+			continue;
+		fdmax = fd;
+	}
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	if (select(fdmax + 1, &rfds, &wfds, NULL, &tv) < 0)
+		return -1;
+	for (n = 0, fd = 0; fd < fdwatchsz && n < MAXEVENTS; fd++) {
+		if (!fdwatch[fd])
+			continue;
+		if (fdwatch[fd]->out && !fdwatch[fd]->wr) {
+			/* select(2) can't wait for POLLERR alone */
+			pfd.fd = fd;
+			pfd.events = 0;
+			if (poll(&pfd, 1, 0) > 0)
+				evready[n++] = fdwatch[fd];
+		} else if (fd <= fdmax && (FD_ISSET(fd, &rfds) || FD_ISSET(fd, &wfds))) {
+			evready[n++] = fdwatch[fd];
+		}
+	}
+	evsort(n);
+	return n;
+#endif
+}
+
+static void
+watchinit(struct watch *w, int *fd, int type, void *p, int idx)
+{
+	w->fd = fd;
+	w->type = type;
+	w->p = p;
+	w->idx = idx;
+	w->out = 0;
+	w->wr = 0;
+	w->on = 0;
+}
+
+static void
+watchon(struct watch *w, int on)
+{
+	if (!w->fd || w->on == on)
+		return;
+	w->on = on;
+	if (on)
+		evadd(w);
+	else
+		evdel(w);
+}
+
+/* Also wake up once the write end of the watch accepts data */
+static void
+watchwrite(struct watch *w, int wr)
+{
+	if (w->wr == wr)
+		return;
+	w->wr = wr;
+	if (w->on)
+		evmod(w);
+}
+
+static void
+watchclose(struct watch *w)
+{
+	if (*w->fd == -1)
+		return;
+	watchon(w, 0);
+	w->wr = 0;
+	close(*w->fd);
+	*w->fd = -1;
+}
+
+/* Milliseconds on the monotonic clock */
+static uint64_t
+mstime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Only monitor the input FIFOs that can be acted upon in the current
+ * state, and only visit friends with transfers or calls in the loop
+ */
+static void
+friendwatch(struct friend *f)
+{
+	struct transfer *t;
+	size_t i;
+	int    online, active, busy = 0, idle = 0;
+
+	online = f->conn != TOX_CONNECTION_NONE;
+	watchon(&f->w[FTEXT_IN], online);
+	watchon(&f->w[FCALL_IN], online && (!f->av.state ||
+	        ((f->av.state & TRANSMITTING) && !(f->av.state & QUEUED))));
+	watchon(&f->w[FVIDEO_IN], online && VIDEOBITRATE && (f->av.state & TRANSMITTING));
+	watchon(&f->w[FREMOVE], 1);
+	for (i = 0; i < MAXTRANSFERS; i++) {
+		t = &f->tx[i];
+		/* only file_in of the next free slot waits for writers */
+		if (t->state == TRANSFER_NONE && !idle && t->fd < 0)
+			t->fd = fifoopen(f->dirfd, t->fifo);
+		watchon(&t->w, online && t->fd >= 0 && (t->state == TRANSFER_NONE ||
+		        (t->filefd < 0 && !t->eof && t->ring.len < t->ring.sz)));
+		idle |= t->state == TRANSFER_NONE;
+		busy |= t->state != TRANSFER_NONE || f->rx[i].state != TRANSFER_NONE;
+	}
+	watchon(&f->w[FFILE_PATH], online && idle && !linesready(&f->paths));
+
+	active = online && (busy || f->av.state);
+	if (active && !f->active)
+		TAILQ_INSERT_TAIL(&activehead, f, aentry);
+	else if (!active && f->active)
+		TAILQ_REMOVE(&activehead, f, aentry);
+	f->active = active;
+}
+
+static void
+cbcallinvite(ToxAV *av, uint32_t fnum, bool audio, bool video, void *udata)
+{
+	struct  friend *f;
+
+	f = friendget(fnum);
+	if (!f)
+		return;
+
+	if (!audio) {
+		if (!toxav_call_control(toxav, f->num, TOXAV_CALL_CONTROL_CANCEL, NULL))
+			weprintf("Failed to reject call\n");
+		logmsg(": %s : Audio > Rejected (no audio)\n", f->name);
+		return;
+	}
+
+	if (callsetup(f) < 0) {
+		if (!toxav_call_control(toxav, f->num, TOXAV_CALL_CONTROL_CANCEL, NULL))
+			weprintf("Failed to reject call\n");
+		logmsg(": %s : Audio > Rejected (too many calls)\n", f->name);
+		return;
+	}
+	f->av.state |= RINGING;
+	friendwatch(f);
+	ftruncate(f->fd[FCALL_STATE], 0);
+	lseek(f->fd[FCALL_STATE], 0, SEEK_SET);
+	dprintf(f->fd[FCALL_STATE], "pending\n");
+
+	logmsg(": %s : Audio > Ringing\n", f->name);
+}
+
+static void
+cbcallstate(ToxAV *av, uint32_t fnum, uint32_t state, void *udata)
+{
+	struct friend *f;
+
+	f = friendget(fnum);
+	if (!f)
+		return;
+
+	if ((state & TOXAV_FRIEND_CALL_STATE_ERROR)
+	    || (state & TOXAV_FRIEND_CALL_STATE_FINISHED)) {
+		f->av.state &= ~TRANSMITTING;
+		logmsg(": %s : Audio > Finished\n", f->name);
+		cleanupcall(f);
+		return;
+	}
+
+	/*
+	 * If we've are ringing a friend, and he sends a control that's
+	 * not FINISHED, it means he accepted the call, so we can start
+	 * transmitting audio frames
+	 */
+	if (f->av.state & RINGING) {
+		f->av.state &= ~RINGING;
+		f->av.state |= TRANSMITTING;
+		friendwatch(f);
+		logmsg(": %s : Audio > Transmitting\n", f->name);
+	}
+	f->av.vhidden = !(state & TOXAV_FRIEND_CALL_STATE_ACCEPTING_V);
+}
+
+static void
+cbcalldata(ToxAV *av, uint32_t fnum, const int16_t *data, size_t len,
+           uint8_t channels, uint32_t rate, void *udata)
+{
+	struct friend *f;
+	struct avframe *fr;
+
+	if (!onavthread()) {
+		f = friendget(fnum);
+		if (f)
+			callrecv(f, data, len, channels, rate, mstime());
+		return;
+	}
+
+	/* the loop owns the friends, hand the frame over */
+	if (len * channels > AVMAXSAMPLES || !(fr = avqreserve(&avrx)))
+		return;
+	fr->kind = AVAUDIO;
+	fr->fnum = fnum;
+	fr->arrived = mstime();
+	fr->rate = rate;
+	fr->channels = channels;
+	fr->len = len;
+	memcpy(fr->pcm, data, len * channels * sizeof(int16_t));
+	avqpush(&avrx);
+}
+
+static void
+callrecv(struct friend *f, const int16_t *data, size_t len, uint8_t channels,
+         uint32_t rate, uint64_t now)
+{
+	static uint8_t buf[AVMAXSAMPLES * sizeof(float)];
+	struct   ring *jb;
+	struct   pcmfmt in;
+	uint64_t expect, dev;
+	size_t   n;
+
+	/* call_out is opened by the loop once it has a reader */
+	if (!(f->av.state & INCOMING))
+		return;
+	if (!channels || channels > 2 || !rate || rate > 48000 || len * 1000 / rate > 120)
+		return;
+
+	if (!f->av.tick)
+		jbreset(f);
+	if (rate != f->av.rate || channels != f->av.channels) {
+		f->av.rate = rate;
+		f->av.channels = channels;
+		memset(f->av.rxcarry, 0, sizeof(f->av.rxcarry));
+	}
+	jb = &f->av.jb;
+
+	/*
+	 * interarrival jitter estimate as in RFC 3550, a longer gap is
+	 * the friend's voice activity detection and not jitter
+	 */
+	if (f->av.arrived && now - f->av.arrived <= JITTERMAX) {
+		expect = len * 1000 / rate;
+		dev = now - f->av.arrived;
+		dev = dev > expect ? dev - expect : expect - dev;
+		f->av.jitter += dev - f->av.jitter / 16;
+	}
+	f->av.arrived = now;
+
+	in.f32 = 0;
+	in.channels = channels;
+	in.rate = rate;
+	in.ms = f->av.fmt.ms;
+	len = pcmconv(buf, &f->av.fmt, data, &in, len, f->av.rxcarry);
+
+	n = MIN(len * pcmsize(&f->av.fmt), jb->sz);
+	if (jb->len + n > jb->sz) {
+		/* drop the oldest audio rather than fall further behind */
+		ringdrop(jb, jb->len + n - jb->sz);
+		f->av.overruns++;
+	}
+	ringput(jb, buf, n);
+}
+
+static void
+cbvideodata(ToxAV *av, uint32_t fnum, uint16_t w, uint16_t h, const uint8_t *y,
+            const uint8_t *u, const uint8_t *v, int32_t ystride, int32_t ustride,
+            int32_t vstride, void *udata)
+{
+	struct friend *f;
+	struct vframe *fr;
+	uint8_t *buf;
+
+	if (!w || !h)
+		return;
+	if (!onavthread()) {
+		f = friendget(fnum);
+		if (f && (buf = videobuf(f))) {
+			videoscale(buf, w, h, y, u, v, ystride, ustride, vstride);
+			flushvideo(f);
+		}
+		return;
+	}
+
+	/* the loop is behind, the frame is stale by the time it gets there */
+	if (!(fr = avqreserve(&vrx)))
+		return;
+	fr->fnum = fnum;
+	videoscale(fr->yuv, w, h, y, u, v, ystride, ustride, vstride);
+	avqpush(&vrx);
+}
+
+/* Nearest neighbour scaling of a plane whose stride may be negative */
+static void
+planescale(uint8_t *dst, size_t dw, size_t dh, const uint8_t *src,
+           size_t sw, size_t sh, int32_t stride)
+{
+	const uint8_t *row;
+	size_t x, y;
+
+	for (y = 0; y < dh; y++, dst += dw) {
+		row = src + (long)(y * sh / dh) * stride;
+		if (sw == dw) {
+			memcpy(dst, row, dw);
+			continue;
+		}
+		for (x = 0; x < dw; x++)
+			dst[x] = row[x * sw / dw];
+	}
+}
+
+/* Fits a received frame into a VIDEOWIDTH x VIDEOHEIGHT I420 frame */
+static void
+videoscale(uint8_t *dst, uint16_t w, uint16_t h, const uint8_t *y, const uint8_t *u,
+           const uint8_t *v, int32_t ystride, int32_t ustride, int32_t vstride)
+{
+	planescale(dst, VIDEOWIDTH, VIDEOHEIGHT, y, w, h, ystride);
+	planescale(dst + VIDEOPLANE, VIDEOWIDTH / 2, VIDEOHEIGHT / 2,
+	           u, (w + 1) / 2, (h + 1) / 2, ustride);
+	planescale(dst + VIDEOPLANE * 5 / 4, VIDEOWIDTH / 2, VIDEOHEIGHT / 2,
+	           v, (w + 1) / 2, (h + 1) / 2, vstride);
+}
+
+/*
+ * The buffer to put the next received frame in, or NULL to drop it
+ * because video_out has no reader or hasn't taken the last frame yet
+ */
+static uint8_t *
+videobuf(struct friend *f)
+{
+	if (f->fd[FVIDEO_OUT] < 0)
+		return NULL;
+	if (f->av.voutleft) {
+		f->av.vdropped++;
+		return NULL;
+	}
+	if (!f->av.vout && !(f->av.vout = malloc(VIDEOFRAMELEN)))
+		eprintf("malloc:");
+	f->av.voutleft = VIDEOFRAMELEN;
+	return f->av.vout;
+}
+
+/* Writes what video_out takes of the frame without blocking */
+static void
+flushvideo(struct friend *f)
+{
+	struct watch *w = &f->w[FVIDEO_OUT];
+	ssize_t n;
+
+	if (!f->av.voutleft) {
+		/* with nothing to write, only the reader leaving wakes us up */
+		watchclose(w);
+		return;
+	}
+	while (f->av.voutleft) {
+		n = write(f->fd[FVIDEO_OUT], f->av.vout + VIDEOFRAMELEN - f->av.voutleft,
+		          f->av.voutleft);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			/* the rest of the frame is of no use to the next reader */
+			watchclose(w);
+			f->av.voutleft = 0;
+			return;
+		}
+		f->av.voutleft -= n;
+	}
+	watchwrite(w, f->av.voutleft > 0);
+}
+
+/* Feed the frames the audio thread received to their calls */
+static void
+avdrain(void)
+{
+	struct friend *f;
+	struct avframe *fr;
+	struct vframe *vf;
+	uint8_t *buf;
+
+	while ((vf = avqfront(&vrx))) {
+		f = friendget(vf->fnum);
+		if (f && (buf = videobuf(f))) {
+			memcpy(buf, vf->yuv, VIDEOFRAMELEN);
+			flushvideo(f);
+		}
+		avqpop(&vrx);
+	}
+	while ((fr = avqfront(&avrx))) {
+		f = friendget(fr->fnum);
+		if (!f)
+			;
+		else if (fr->kind == AVAUDIO)
+			callrecv(f, fr->pcm, fr->len, fr->channels, fr->rate, fr->arrived);
+		else if (fr->kind == AVFAILED)
+			f->av.sendfails++;
+		else if (fr->kind == AVVIDEO)
+			videoresult(f, fr->rate);
+		else
+			callbitrate(f, fr->rate);
+		avqpop(&avrx);
+	}
+}
+
+/* toxav runs some callbacks from toxav_iterate() and some from tox_iterate() */
+static int
+onavthread(void)
+{
+	return avthread && pthread_equal(pthread_self(), avtid);
+}
+
+/* Hands the loop a failed send or a suggestion, dropped if it is behind */
+static void
+avreport(int kind, uint32_t fnum, uint32_t rate)
+{
+	struct avframe *fr;
+
+	if (!(fr = avqreserve(&avrx)))
+		return;
+	fr->kind = kind;
+	fr->fnum = fnum;
+	fr->rate = rate;
+	fr->len = 0;
+	avqpush(&avrx);
+}
+
+static void
+cbcallbitrate(ToxAV *av, uint32_t fnum, uint32_t rate, void *udata)
+{
+	struct friend *f;
+
+	if (onavthread()) {
+		avreport(AVBITRATE, fnum, rate);
+		return;
+	}
+	f = friendget(fnum);
+	if (f)
+		callbitrate(f, rate);
+}
+
+/* toxav saw loss on the way to the friend, follow it down at once */
+static void
+callbitrate(struct friend *f, uint32_t rate)
+{
+	if (!(f->av.state & TRANSMITTING))
+		return;
+	f->av.suggested = rate;
+	if (rate < f->av.bitrate)
+		setbitrate(f, rate);
+}
+
+static void
+setbitrate(struct friend *f, uint32_t rate)
+{
+	rate = MIN(MAX(rate, AUDIOBITRATEMIN), AUDIOBITRATEMAX);
+	if (rate == f->av.bitrate)
+		return;
+	if (!toxav_audio_set_bit_rate(toxav, f->num, rate, NULL)) {
+		weprintf("Failed to set audio bitrate\n");
+		return;
+	}
+	f->av.bitrate = rate;
+}
+
+/*
+ * Every BITRATEDELAY ms cut the bitrate by a quarter if sends failed or
+ * fell behind, else raise it a step, but never above what toxav last
+ * suggested.
+ */
+static void
+ratecall(struct friend *f)
+{
+	uint32_t rate;
+
+	if (!(f->av.state & TRANSMITTING) || mstime() < f->av.nextrate)
+		return;
+	f->av.nextrate = mstime() + BITRATEDELAY;
+
+	if (f->av.sendfails > f->av.failmark || f->av.late)
+		rate = f->av.bitrate * 3 / 4;
+	else
+		rate = f->av.bitrate + 2;
+	if (f->av.suggested)
+		rate = MIN(rate, f->av.suggested);
+	f->av.suggested = 0;
+	f->av.failmark = f->av.sendfails;
+	f->av.late = 0;
+	setbitrate(f, rate);
+}
+
+static void
+cbconfinvite(Tox *m, uint32_t frnum, TOX_CONFERENCE_TYPE type, const uint8_t *cookie, size_t clen, void * udata)
+{
+	size_t i, j, namelen;
+	struct file invfifo;
+	struct invite *inv;
+	struct peer *p;
+	uint8_t id[TOX_PUBLIC_KEY_SIZE];
+
+	if(type != TOX_CONFERENCE_TYPE_TEXT) {
+		weprintf("Only text conferences supported at the moment\n");
+		return;
+	}
+
+	if (!tox_friend_get_public_key(tox, frnum, id, NULL)) {
+		weprintf("Failed to get key by friend %i for invite\n", frnum);
+		return;
+	}
+
+	p = peerget(id, 1);
+	LIST_FOREACH(inv, &p->invs, pentry) {
+		if (inv->cookielen == clen && !memcmp(inv->cookie, cookie, clen))
+			return;
+	}
+
+	inv = calloc(1, sizeof(*inv));
+	if (!inv)
+		eprintf("calloc:");
+	inv->fd = -1;
+
+	inv->inviter = frnum;
+	memcpy(inv->id, id, TOX_PUBLIC_KEY_SIZE);
+	inv->cookielen = clen;
+	inv->cookie = malloc(inv->cookielen);
+	if (!inv->cookie)
+		eprintf("malloc:");
+
+	memcpy(inv->cookie, cookie, clen);
+
+	namelen = 2 * TOX_PUBLIC_KEY_SIZE + 1 + 2 * clen + 2;
+	inv->fifoname = malloc(namelen);
+	if (!inv->fifoname)
+		eprintf("malloc:");
+
+	i = 0;
+	id2str(id, inv->fifoname);
+	i += 2 * TOX_PUBLIC_KEY_SIZE;
+	inv->fifoname[i] = '_';
+	i++;
+	for(j = 0; j < clen; i+=2, j++)
+		sprintf(inv->fifoname + i, "%02X", cookie[j]);
+	i++;
+	inv->fifoname[i] = '\0';
+
+	invfifo.name = inv->fifoname;
+	invfifo.flags = O_RDONLY | O_NONBLOCK;
+	fiforeset(gslots[CONF].fd[OUT], &inv->fd, invfifo);
+	watchinit(&inv->w, &inv->fd, WINVITE, inv, 0);
+	watchon(&inv->w, 1);
+
+	TAILQ_INSERT_TAIL(&invhead, inv, entry);
+	LIST_INSERT_HEAD(&p->invs, inv, pentry);
+
+	logmsg("Invite > %s\n", inv->fifoname);
+}
+
+static void
+cbconfmessage(Tox *m, uint32_t cnum, uint32_t pnum, TOX_MESSAGE_TYPE type, const uint8_t *data, size_t len, void *udata)
+{
+	struct  conference *c;
+	time_t  t;
+	uint8_t msg[len + 1], namt[TOX_MAX_NAME_LENGTH + 1];
+	char    buft[64];
+
+	memcpy(msg, data, len);
+	msg[len] = '\0';
+
+	c = confget(cnum);
+	if (!c)
+		return;
+	t = time(NULL);
+	strftime(buft, sizeof(buft), "%F %R", localtime(&t));
+	if (!tox_conference_peer_get_name(tox, c->num, pnum, namt, NULL)) {
+		weprintf("Unable to obtain name for peer %d in conference %s\n", pnum, c->numstr);
+		return;
+	}
+	namt[tox_conference_peer_get_name_size(tox, c->num, pnum, NULL)] = '\0';
+	dprintf(c->fd[CTEXT_OUT], "%s <%s> %s\n", buft, namt, msg);
+	if (confmsg_log)
+		logmsg("%s : %s <%s> %s\n", c->numstr, buft, namt, msg);
+}
+
+static void
+cbconftitle(Tox *m, uint32_t cnum, uint32_t pnum, const uint8_t *data, size_t len, void * udata)
+{
+	struct  conference *c;
+	char    title[TOX_MAX_NAME_LENGTH + 1];
+
+	memcpy(title, data, len);
+	title[len] = '\0';
+
+	c = confget(cnum);
+	if (!c)
+		return;
+	ftruncate(c->fd[CTITLE_OUT], 0);
+	lseek(c->fd[CTITLE_OUT], 0, SEEK_SET);
+	dprintf(c->fd[CTITLE_OUT], "%s\n", title);
+	logmsg(": %s : Title > %s\n", c->numstr, title);
+}
+
+static void
+cbconfmembers(Tox *m, uint32_t cnum, void *udata)
+{
+	struct  conference *c;
+
+	c = confget(cnum);
+	if (c)
+		writemembers(c);
+}
+
+/* Takes a frame buffer for a new call, -1 if MAXCALLS are running */
+static int
+callalloc(struct friend *f)
+{
+	size_t i;
+
+	if (f->av.frame)
+		return 0;
+	for (i = 0; i < MAXCALLS; i++) {
+		if (!callowners[i]) {
+			callowners[i] = f;
+			f->av.frame = callframes[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void
+callfree(struct friend *f)
+{
+	size_t i;
+
+	for (i = 0; i < MAXCALLS; i++)
+		if (callowners[i] == f)
+			callowners[i] = NULL;
+	f->av.frame = NULL;
+}
+
+/*
+ * Admits a new call unless MAXCALLS are running.  Takes the format of
+ * call_in and call_out from the friend's call_format if there is one.
+ * toxav is fed the same but as s16 and, unless opus codes it,
+ * resampled to AUDIOSAMPLERATE.  The bitrate starts out at AUDIOBITRATE.
+ */
+static int
+callsetup(struct friend *f)
+{
+	struct   pcmfmt *fmt = &f->av.fmt;
+	char     buf[64], enc[4];
+	unsigned ch, rate, ms;
+	ssize_t  n;
+	int      fd;
+
+	if (callalloc(f) < 0)
+		return -1;
+
+	fmt->f32 = 0;
+	fmt->channels = AUDIOCHANNELS;
+	fmt->rate = AUDIOSAMPLERATE;
+	fmt->ms = AUDIOFRAME;
+
+	fd = openat(f->dirfd, "call_format", O_RDONLY);
+	if (fd >= 0) {
+		n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		buf[MAX(n, 0)] = '\0';
+		if (sscanf(buf, "%3s %u %u %u", enc, &ch, &rate, &ms) == 4 &&
+		    (!strcmp(enc, "s16") || !strcmp(enc, "f32")) &&
+		    (ch == 1 || ch == 2) && rate >= 8000 && rate <= 48000 &&
+		    (ms == 10 || ms == 20 || ms == 40 || ms == 60) &&
+		    rate * ms % 1000 == 0) {
+			fmt->f32 = !strcmp(enc, "f32");
+			fmt->channels = ch;
+			fmt->rate = rate;
+			fmt->ms = ms;
+		} else {
+			weprintf("Invalid call_format of %s, using the default\n", f->name);
+		}
+	}
+
+	f->av.net = *fmt;
+	f->av.net.f32 = 0;
+	switch (fmt->rate) {
+	case 8000: case 12000: case 16000: case 24000: case 48000:
+		break;
+	default:
+		f->av.net.rate = AUDIOSAMPLERATE;
+	}
+	f->av.framelen = fmt->rate * fmt->ms / 1000 * pcmsize(fmt);
+	memset(f->av.txcarry, 0, sizeof(f->av.txcarry));
+	memset(f->av.rxcarry, 0, sizeof(f->av.rxcarry));
+
+	f->av.bitrate = AUDIOBITRATE;
+	f->av.suggested = 0;
+	f->av.nextrate = mstime() + BITRATEDELAY;
+	f->av.sendfails = 0;
+	f->av.failmark = 0;
+	f->av.late = 0;
+
+	f->av.lastvoice = 0;
+	f->av.nextnoise = 0;
+	f->av.noise = 0;
+	f->av.frames = 0;
+	f->av.suppressed = 0;
+
+	f->av.vsent = 0;
+	f->av.vdropped = 0;
+	f->av.vfailing = 0;
+	f->av.vhidden = 0;
+	return 0;
+}
+
+static void
+jbreset(struct friend *f)
+{
+	jbfree(f);
+	f->av.tick = f->av.framelen;
+	ringinit(&f->av.jb, f->av.tick * (JITTERMAX / f->av.fmt.ms));
+	f->av.last = calloc(1, f->av.tick);
+	if (!f->av.last)
+		eprintf("calloc:");
+	f->av.outleft = 0;
+	f->av.playing = 0;
+	f->av.missed = 0;
+	f->av.nextplay = mstime() + f->av.fmt.ms;
+	f->av.arrived = 0;
+	f->av.jitter = 0;
+}
+
+static void
+jbfree(struct friend *f)
+{
+	ringfree(&f->av.jb);
+	free(f->av.last);
+	f->av.last = NULL;
+	f->av.tick = 0;
+}
+
+/* Bytes to buffer before playing: twice the jitter, within bounds */
+static size_t
+jbtarget(struct friend *f)
+{
+	uint64_t ms;
+
+	ms = MAX(JITTERDELAY, 2 * f->av.jitter / 16 + f->av.fmt.ms);
+	ms = MIN(ms, JITTERMAX / 2);
+	return (ms + f->av.fmt.ms - 1) / f->av.fmt.ms * f->av.tick;
+}
+
+/*
+ * Play the ticks that are due into call_out, each with received audio
+ * or, if there is none, with the last tick faded or silence.  Returns
+ * the ms until the next tick.
+ */
+static uint32_t
+playcall(struct friend *f)
+{
+	struct   ring *jb = &f->av.jb;
+	int16_t *s;
+	float   *x;
+	uint8_t *p;
+	uint64_t now;
+	size_t   i, target;
+
+	now = mstime();
+	if (now > f->av.nextplay + JITTERMAX)
+		f->av.nextplay = now; /* the loop was held up, don't catch up */
+	target = jbtarget(f);
+	while (now >= f->av.nextplay) {
+		f->av.nextplay += f->av.fmt.ms;
+		if (f->av.outleft) {
+			if (writecall(f) < 0)
+				break;
+			if (f->av.outleft) {
+				/* the reader is behind, drop a whole tick */
+				if (f->av.playing && jb->len >= f->av.tick)
+					ringdrop(jb, f->av.tick);
+				f->av.overruns++;
+				continue;
+			}
+		}
+		if (!f->av.playing && jb->len >= target)
+			f->av.playing = 1;
+		if (f->av.playing && jb->len >= f->av.tick) {
+			p = ringpeek(jb, f->av.last, f->av.tick);
+			if (p != f->av.last)
+				memcpy(f->av.last, p, f->av.tick);
+			ringdrop(jb, f->av.tick);
+			f->av.missed = 0;
+			/* a sender running fast fills the buffer, skip ahead */
+			if (jb->len > 2 * target) {
+				ringdrop(jb, f->av.tick);
+				f->av.overruns++;
+			}
+		} else {
+			if (f->av.playing)
+				f->av.underruns++;
+			f->av.playing = 0;
+			if (f->av.fmt.f32) {
+				x = (float *)f->av.last;
+				for (i = 0; i < f->av.tick / sizeof(float); i++)
+					x[i] = f->av.missed ? 0 : x[i] / 2;
+			} else {
+				s = (int16_t *)f->av.last;
+				for (i = 0; i < f->av.tick / sizeof(int16_t); i++)
+					s[i] = f->av.missed ? 0 : s[i] / 2;
+			}
+			f->av.missed++;
+		}
+		f->av.outleft = f->av.tick;
+		if (writecall(f) < 0)
+			break;
+	}
+	return f->av.nextplay > now ? f->av.nextplay - now : 0;
+}
+
+/*
+ * Writes what call_out takes of the last tick.  The rest is finished
+ * before the next tick, so the reader never gets a tick cut short.
+ * Returns -1 once call_out lost its reader.
+ */
+static int
+writecall(struct friend *f)
+{
+	ssize_t n;
+
+	n = write(f->fd[FCALL_OUT], f->av.last + f->av.tick - f->av.outleft,
+	          f->av.outleft);
+	if (n < 0 && errno == EPIPE) {
+		watchclose(&f->w[FCALL_OUT]);
+		f->av.state &= ~INCOMING;
+		f->av.outleft = 0;
+		return -1;
+	}
+	if (n > 0)
+		f->av.outleft -= n;
+	return 0;
+}
+
+static void
+writecallstats(struct friend *f)
+{
+	ftruncate(f->fd[FCALL_STATS], 0);
+	lseek(f->fd[FCALL_STATS], 0, SEEK_SET);
+	dprintf(f->fd[FCALL_STATS], "underruns %llu\noverruns %llu\njitter %llu\n"
+	        "delay %llu\nqueued %llu\nbitrate %u\nsendfails %llu\nsuppressed %llu\n"
+	        "video_sent %llu\nvideo_dropped %llu\n",
+	        (unsigned long long)f->av.underruns, (unsigned long long)f->av.overruns,
+	        (unsigned long long)f->av.jitter / 16,
+	        (unsigned long long)(f->av.tick ? jbtarget(f) / f->av.tick * f->av.fmt.ms : 0),
+	        (unsigned long long)(f->av.tick ? f->av.jb.len / f->av.tick * f->av.fmt.ms : 0),
+	        f->av.bitrate, (unsigned long long)f->av.sendfails,
+	        (unsigned long long)(f->av.frames ? f->av.suppressed * 100 / f->av.frames : 0),
+	        (unsigned long long)f->av.vsent, (unsigned long long)f->av.vdropped);
+}
+
+static void
+cleanupcall(struct friend *f)
+{
+	f->av.state = 0;
+
+	writecallstats(f);
+	jbfree(f);
+	f->av.underruns = 0;
+	f->av.overruns = 0;
+
+	/* Cancel Rx side of the call */
+	watchclose(&f->w[FCALL_OUT]);
+	watchclose(&f->w[FVIDEO_OUT]);
+	free(f->av.vout);
+	f->av.vout = NULL;
+	f->av.voutleft = 0;
+	ftruncate(f->fd[FCALL_STATE], 0);
+	lseek(f->fd[FCALL_STATE], 0, SEEK_SET);
+	dprintf(f->fd[FCALL_STATE], "none\n");
+
+	/* Cancel Tx side of the call */
+	callfree(f);
+	fiforeset(f->dirfd, &f->fd[FCALL_IN], ffiles[FCALL_IN]);
+	free(f->av.vin);
+	f->av.vin = NULL;
+	f->av.vinlen = 0;
+	fiforeset(f->dirfd, &f->fd[FVIDEO_IN], ffiles[FVIDEO_IN]);
+	friendwatch(f);
+}
+
+static void
+cancelcall(struct friend *f, char *action)
+{
+	logmsg(": %s : Audio > %s\n", f->name, action);
+
+	if (f->av.state & TRANSMITTING || f->av.state & RINGING) {
+		if (!toxav_call_control(toxav, f->num, TOXAV_CALL_CONTROL_CANCEL, NULL))
+			weprintf("Failed to terminate call\n");
+	}
+	cleanupcall(f);
+}
+
+static void
+sendfriendcalldata(struct friend *f)
+{
+	ssize_t  n;
+
+	n = fiforead(f->dirfd, &f->fd[FCALL_IN], ffiles[FCALL_IN],
+		     f->av.frame + (f->av.state & INCOMPLETE ? f->av.n : 0),
+		     f->av.framelen - (f->av.state & INCOMPLETE ? f->av.n : 0));
+	if (n == 0) {
+		f->av.state &= ~OUTGOING;
+		f->av.state &= ~INCOMPLETE;
+		return;
+	} else if (n < 0 || f->av.state & RINGING) {
+		/* discard data as long as the call is not established */
+		return;
+	} else if (n == (f->av.framelen - (f->av.state & INCOMPLETE ? f->av.n : 0))) {
+		f->av.state &= ~INCOMPLETE;
+		f->av.n = 0;
+	} else {
+		f->av.state |= INCOMPLETE;
+		f->av.n += n;
+		return;
+	}
+
+	/* stop reading call_in until sendcall() is done with the frame */
+	f->av.state |= QUEUED;
+	f->av.queued = mstime();
+	friendwatch(f);
+}
+
+/*
+ * Sends the queued frame once its deadline has come and returns the
+ * ms until then.  Deadlines are a frame apart, so the loop paces the
+ * frames without ever sleeping in here.
+ */
+static uint32_t
+sendcall(struct friend *f)
+{
+	static int16_t pcm[AVMAXSAMPLES];
+	struct   avframe *fr;
+	uint64_t now;
+	size_t   n;
+	TOXAV_ERR_SEND_FRAME err;
+
+	if (!(f->av.state & QUEUED))
+		return UINT32_MAX;
+	now = mstime();
+	if (now < f->av.nextsend)
+		return f->av.nextsend - now;
+
+	/* the audio thread is behind, retry on the next ms */
+	if (avthread && !(fr = avqreserve(&avtx))) {
+		f->av.late++;
+		return 1;
+	}
+
+	n = pcmconv(pcm, &f->av.net, f->av.frame, &f->av.fmt,
+	            f->av.framelen / pcmsize(&f->av.fmt), f->av.txcarry);
+	f->av.frames++;
+	if (!vadsend(f, pcm, n * f->av.net.channels, now)) {
+		f->av.suppressed++;
+	} else if (avthread) {
+		fr->fnum = f->num;
+		fr->rate = f->av.net.rate;
+		fr->channels = f->av.net.channels;
+		fr->len = n;
+		memcpy(fr->pcm, pcm, n * f->av.net.channels * sizeof(int16_t));
+		avqpush(&avtx);
+		write(avpipe[1], "", 1);
+	} else if (!toxav_audio_send_frame(toxav, f->num, pcm, n, f->av.net.channels,
+	                                   f->av.net.rate, &err)) {
+		weprintf("Failed to send audio frame: %s\n", callerr[err]);
+		f->av.sendfails++;
+	}
+	/* held up past the next frame's deadline, with the frame at hand */
+	if (f->av.nextsend && now >= MAX(f->av.nextsend, f->av.queued) + f->av.fmt.ms)
+		f->av.late++;
+
+	/* a late frame restarts the clock rather than bursting to catch up */
+	f->av.nextsend = MAX(f->av.nextsend, now - f->av.fmt.ms) + f->av.fmt.ms;
+	f->av.state &= ~QUEUED;
+	friendwatch(f);
+	return f->av.nextsend - now;
+}
+
+/*
+ * Voice activity detection on a frame about to be sent.  Frames below
+ * VADLEVEL are still sent until VADHANGOVER ms after the last one above
+ * it, then dropped, but for one of comfort noise at their level every
+ * VADNOISE ms.  Returns whether to send the frame.
+ */
+static int
+vadsend(struct friend *f, int16_t *pcm, size_t n, uint64_t now)
+{
+	double ms, a;
+	size_t i;
+
+	if (!VADLEVEL || !n)
+		return 1;
+
+	/* mean square against the level in dBFS, both relative to 1 << 30 */
+	ms = (double)sumsq(pcm, n) / n / (32768.0 * 32768);
+	if (ms >= pow(10, VADLEVEL / 10.0)) {
+		f->av.lastvoice = now;
+		return 1;
+	}
+	f->av.noise = f->av.noise ? (f->av.noise * 7 + ms) / 8 : ms;
+	if (now < f->av.lastvoice + VADHANGOVER)
+		return 1;
+	if (now < f->av.nextnoise)
+		return 0;
+
+	/* uniform noise in [-a, a] has a mean square of a * a / 3 */
+	f->av.nextnoise = now + VADNOISE;
+	a = sqrt(3 * f->av.noise) * 32768;
+	for (i = 0; i < n; i++)
+		pcm[i] = lrint((2.0 * rand() / RAND_MAX - 1) * a);
+	return 1;
+}
+
+static void
+sendfriendvideo(struct friend *f)
+{
+	struct  vframe *fr;
+	ssize_t n;
+
+	if (!f->av.vin && !(f->av.vin = malloc(VIDEOFRAMELEN)))
+		eprintf("malloc:");
+	n = fiforead(f->dirfd, &f->fd[FVIDEO_IN], ffiles[FVIDEO_IN],
+	             f->av.vin + f->av.vinlen, VIDEOFRAMELEN - f->av.vinlen);
+	if (n == 0) {
+		/* the next writer starts on a new frame */
+		f->av.vinlen = 0;
+		return;
+	} else if (n < 0) {
+		return;
+	}
+	f->av.vinlen += n;
+	if (f->av.vinlen < VIDEOFRAMELEN)
+		return;
+	f->av.vinlen = 0;
+
+	/* the friend turned video off, keep draining video_in quietly */
+	if (f->av.vhidden)
+		return;
+	if (!avthread) {
+		videoresult(f, sendvideo(f->num, f->av.vin));
+	} else if ((fr = avqreserve(&vtx))) {
+		fr->fnum = f->num;
+		fr->failing = f->av.vfailing;
+		memcpy(fr->yuv, f->av.vin, VIDEOFRAMELEN);
+		avqpush(&vtx);
+		write(avpipe[1], "", 1);
+	} else {
+		/* the audio thread is behind, a newer frame will do */
+		return;
+	}
+	f->av.vsent++;
+}
+
+static TOXAV_ERR_SEND_FRAME
+sendvideo(uint32_t fnum, const uint8_t *yuv)
+{
+	TOXAV_ERR_SEND_FRAME err;
+
+	if (!toxav_video_send_frame(toxav, fnum, VIDEOWIDTH, VIDEOHEIGHT, yuv,
+	                            yuv + VIDEOPLANE, yuv + VIDEOPLANE * 5 / 4, &err))
+		return err;
+	return TOXAV_ERR_SEND_FRAME_OK;
+}
+
+/* Warn when frames stop going through, not for every frame refused */
+static void
+videoresult(struct friend *f, TOXAV_ERR_SEND_FRAME err)
+{
+	if (err == TOXAV_ERR_SEND_FRAME_OK) {
+		f->av.vfailing = 0;
+		return;
+	}
+	if (!f->av.vfailing)
+		weprintf("Failed to send video frame: %s\n", callerr[err]);
+	f->av.vfailing = 1;
+}
+
+static void
+writemembers(struct conference *c)
+{
+	size_t i;
+	uint32_t peers, pnum;
+	uint8_t name[TOX_MAX_NAME_LENGTH + 1];
+	TOX_ERR_CONFERENCE_PEER_QUERY err;
+
+	/*The peer list is written when we invite the members by the callback*/
+	ftruncate(c->fd[CMEMBERS], 0);
+	peers = tox_conference_peer_count(tox, c->num, &err);
+
+	if (err != TOX_ERR_CONFERENCE_PEER_QUERY_OK) {
+		weprintf("Unable to obtain peer count for conference %d\n", c->num);
+		return;
+	}
+	for (pnum = 0; pnum < peers; pnum++) {
+		if (!tox_conference_peer_get_name(tox, c->num, pnum, name, NULL)) {
+			weprintf("Unable to obtain the name for peer %d\n", pnum);
+		} else {
+			i = tox_conference_peer_get_name_size(tox, c->num, pnum, NULL);
+			name[i] = '\0';
+			dprintf(c->fd[CMEMBERS], "%s\n", name);
+		}
+	}
+}
+
+static void
+cbconnstatus(Tox *m, uint32_t frnum, TOX_CONNECTION status, void *udata)
+{
+	struct friend *f;
+	struct peer *p;
+	size_t r;
+	char   name[TOX_MAX_NAME_LENGTH + 1];
+	TOX_ERR_FRIEND_QUERY err;
+
+	r = tox_friend_get_name_size(tox, frnum, &err);
+	if (err != TOX_ERR_FRIEND_QUERY_OK) {
+		weprintf("Failed to get name for friend number %ld\n", (long)frnum);
+		return;
+	} else if (r == 0) {
+		snprintf(name, sizeof(name), "Anonymous");
+	} else {
+		tox_friend_get_name(tox, frnum, (uint8_t *)name, NULL);
+		name[r] = '\0';
+	}
+
+	logmsg(": %s : Connection > %s\n", name, status == TOX_CONNECTION_NONE ? "Offline" : "Online");
+
+	f = friendget(frnum);
+	if (!f)
+		return;
+	f->conn = status;
+	ftruncate(f->fd[FONLINE], 0);
+	lseek(f->fd[FONLINE], 0, SEEK_SET);
+	dprintf(f->fd[FONLINE], "%d\n", status);
+	if (status == TOX_CONNECTION_NONE)
+		suspendtransfers(f);
+	else
+		resumetransfers(f);
+	spoolfriend(f);
+	friendwatch(f);
+
+	/* Remove the pending request-FIFO if it exists */
+	p = peerget(f->id, 0);
+	if (p && p->req)
+		requestdestroy(p->req);
+}
+
+static void
+cbfriendmessage(Tox *m, uint32_t frnum, TOX_MESSAGE_TYPE type, const uint8_t *data, size_t len, void *udata)
+{
+	struct  friend *f;
+	time_t  t;
+	uint8_t msg[len + 1];
+	char    buft[64];
+
+	memcpy(msg, data, len);
+	msg[len] = '\0';
+
+	f = friendget(frnum);
+	if (!f)
+		return;
+	t = time(NULL);
+	strftime(buft, sizeof(buft), "%F %R", localtime(&t));
+	dprintf(f->fd[FTEXT_OUT], "%s %s\n", buft, msg);
+	if (friendmsg_log)
+		logmsg(": %s > %s\n", f->name, msg);
+}
+
+static void
+cbfriendrequest(Tox *m, const uint8_t *id, const uint8_t *data, size_t len, void *udata)
+{
+	struct file reqfifo;
+	struct request *req;
+	struct peer *p;
+	char  *msg;
+
+	if (len > 0) {
+		msg = malloc(len + 1);
+		if (!msg)
+			eprintf("malloc:");
+		memcpy(msg, data, len);
+		msg[len] = '\0';
+	} else {
+		msg = strdup("ratox is awesome!");
+		if (!msg)
+			eprintf("strdup:");
+	}
+
+	/* A repeated request only updates the pending one */
+	p = peerget(id, 1);
+	if (p->req) {
+		free(p->req->msg);
+		p->req->msg = msg;
+		logmsg("Request > %s : %s\n", p->req->idstr, msg);
+		return;
+	}
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		eprintf("calloc:");
+	req->fd = -1;
+	req->msg = msg;
+
+	memcpy(req->id, id, TOX_PUBLIC_KEY_SIZE);
+	id2str(req->id, req->idstr);
+	p->req = req;
+
+	reqfifo.name = req->idstr;
+	reqfifo.flags = O_RDONLY | O_NONBLOCK;
+	fiforeset(gslots[REQUEST].fd[OUT], &req->fd, reqfifo);
+	watchinit(&req->w, &req->fd, WREQUEST, req, 0);
+	watchon(&req->w, 1);
+
+	TAILQ_INSERT_TAIL(&reqhead, req, entry);
+
+	logmsg("Request > %s : %s\n",
+	       req->idstr, req->msg);
+}
+
+static void
+cbnamechange(Tox *m, uint32_t frnum, const uint8_t *data, size_t len, void *user)
+{
+	struct  friend *f;
+	uint8_t name[len + 1];
+
+	memcpy(name, data, len);
+	name[len] = '\0';
+
+	f = friendget(frnum);
+	if (f && memcmp(f->name, name, len + 1) != 0) {
+		ftruncate(f->fd[FNAME], 0);
+		lseek(f->fd[FNAME], 0, SEEK_SET);
+		dprintf(f->fd[FNAME], "%s\n", name);
+		logmsg(": %s : Name > %s\n", f->name, name);
+		memcpy(f->name, name, len + 1);
+	}
+	datasave();
+}
+
+static void
+cbstatusmessage(Tox *m, uint32_t frnum, const uint8_t *data, size_t len, void *udata)
+{
+	struct friend *f;
+	uint8_t status[len + 1];
+
+	memcpy(status, data, len);
+	status[len] = '\0';
+
+	f = friendget(frnum);
+	if (f) {
+		ftruncate(f->fd[FSTATUS], 0);
+		lseek(f->fd[FSTATUS], 0, SEEK_SET);
+		dprintf(f->fd[FSTATUS], "%s\n", status);
+		logmsg(": %s : Status > %s\n", f->name, status);
+	}
+	datasave();
+}
+
+static void
+cbfriendstate(Tox *m, uint32_t frnum, TOX_USER_STATUS state, void *udata)
+{
+	struct friend *f;
+
+	if (state >= LEN(ustate)) {
+		weprintf("Received invalid user status: %d\n", state);
+		return;
+	}
+
+	f = friendget(frnum);
+	if (f) {
+		ftruncate(f->fd[FSTATE], 0);
+		lseek(f->fd[FSTATE], 0, SEEK_SET);
+		dprintf(f->fd[FSTATE], "%s\n", ustate[state]);
+		logmsg(": %s : State > %s\n", f->name, ustate[state]);
+	}
+	datasave();
+}
+
+static void
+cbfilecontrol(Tox *m, uint32_t frnum, uint32_t fnum, TOX_FILE_CONTROL ctrltype, void *udata)
+{
+	struct friend *f;
+	struct transfer *t;
+
+	f = friendget(frnum);
+	if (!f)
+		return;
+
+	/* Our own pausing and resuming of receives needs no tracking */
+	if ((t = transferget(f->rx, fnum))) {
+		if (ctrltype == TOX_FILE_CONTROL_CANCEL) {
+			logmsg(": %s : %s > Cancelled by Sender\n", f->name, t->tag);
+			t->state = TRANSFER_FLUSHING; /* nothing left to cancel */
+			cancelrxtransfer(t);
+		}
+		return;
+	}
+	if (!(t = transferget(f->tx, fnum)))
+		return;
+
+	switch (ctrltype) {
+	case TOX_FILE_CONTROL_RESUME:
+		if (t->state == TRANSFER_PAUSED) {
+			logmsg(": %s : %s > Resumed\n", f->name, t->tag);
+			t->state = TRANSFER_INPROGRESS;
+			sendfriendfiledata(f);
+		} else if (t->state == TRANSFER_INITIATED) {
+			t->state = TRANSFER_INPROGRESS;
+			logmsg(": %s : %s > In Progress\n", f->name, t->tag);
+		}
+		break;
+	case TOX_FILE_CONTROL_PAUSE:
+		if (t->state == TRANSFER_INPROGRESS) {
+			logmsg(": %s : %s > Paused\n", f->name, t->tag);
+			t->state = TRANSFER_PAUSED;
+			t->st.pauses++;
+		}
+		break;
+	case TOX_FILE_CONTROL_CANCEL:
+		logmsg(": %s : %s > Rejected\n", f->name, t->tag);
+		/* a spool file stays for the next scan to offer again */
+		if (t->spool)
+			memset(&f->spooltime, 0, sizeof(f->spooltime));
+		endtxtransfer(t);
+		break;
+	default:
+		weprintf("Unhandled file control type: %d\n", ctrltype);
+		break;
+	};
+	friendwatch(f);
+}
+
+static void
+cbfiledatareq(Tox *m, uint32_t frnum, uint32_t fnum, uint64_t pos, size_t flen, void *udata)
+{
+	struct friend *f;
+	struct transfer *t;
+
+	f = friendget(frnum);
+	if (!f || !(t = transferget(f->tx, fnum)))
+		return;
+
+	if (!flen) {
+		logmsg(": %s : %s > Complete\n", f->name, t->tag);
+		senddigest(t);
+		spooldone(t);
+		endtxtransfer(t);
+		return;
+	}
+
+	if (flen > TOX_MAX_CUSTOM_PACKET_SIZE) {
+		weprintf("Requested file chunk is too large\n");
+		canceltxtransfer(t);
+		return;
+	}
+
+	/* A resuming receiver asks for the rest of the file only */
+	if (pos != t->reqend && t->filefd >= 0) {
+		if (!t->share && lseek(t->filefd, pos, SEEK_SET) < 0) {
+			weprintf("lseek %s:", t->path);
+			canceltxtransfer(t);
+			return;
+		}
+		ringdrop(&t->ring, t->ring.len);
+		t->pos = pos;
+		t->eof = 0;
+		logmsg(": %s : %s > Resumed at %llu\n", f->name, t->tag,
+		       (unsigned long long)pos);
+	}
+
+	/*
+	 * Requests are not repeated and chunks have to be sent in order,
+	 * so only remember what was asked for and send whatever is
+	 * already read ahead; the rest follows once file_in has it.
+	 * Only the last chunk may be short, even if its request came in
+	 * before earlier ones were served.
+	 */
+	t->reqend = pos + flen;
+	t->reqlen = MAX(t->reqlen, flen);
+	sendfriendfiledata(f);
+}
+
+/*
+ * The sender's digest may come in before or after the last chunk;
+ * it goes to the receive of that file id under way or just completed
+ * that is still waiting for one
+ */
+static void
+cbfiledigest(Tox *m, uint32_t frnum, const uint8_t *data, size_t len, void *udata)
+{
+	struct friend *f;
+	struct transfer *t;
+	size_t i;
+
+	f = friendget(frnum);
+	if (!f || len != 1 + TOX_FILE_ID_LENGTH + crypto_generichash_BYTES ||
+	    data[0] != PKTFILEDIGEST)
+		return;
+	for (i = 0; i < MAXTRANSFERS; i++) {
+		t = &f->rx[i];
+		if (t->havepeerdigest || memcmp(t->id, data + 1, TOX_FILE_ID_LENGTH))
+			continue;
+		if (t->state == TRANSFER_NONE && t->digeststate != DIGEST_DONE)
+			continue;
+		memcpy(t->peerdigest, data + 1 + TOX_FILE_ID_LENGTH, sizeof(t->peerdigest));
+		t->havepeerdigest = 1;
+		digestcheck(t);
+		return;
+	}
+}
+
+static void
+cbfilesendreq(Tox *m, uint32_t frnum, uint32_t fnum, uint32_t kind, uint64_t fsz,
+	      const uint8_t *fname, size_t flen, void *udata)
+{
+	struct  friend *f;
+	struct  transfer *t;
+	uint8_t filename[flen + 1], id[TOX_FILE_ID_LENGTH];
+	size_t  i;
+	int     fd;
+
+	f = friendget(frnum);
+	if (!f)
+		return;
 
-	/* Cancel Rx side of the call */
-	if (f->fd[FCALL_OUT] != -1) {
-		close(f->fd[FCALL_OUT]);
-		f->fd[FCALL_OUT] = -1;
+	memcpy(filename, fname, flen);
+	filename[flen] = '\0';
+
+	if (kind == TOX_FILE_KIND_AVATAR) {
+		if (!tox_file_control(tox, f->num, fnum, TOX_FILE_CONTROL_CANCEL, NULL))
+			weprintf("Failed to kill avatar transfer\n");
+		return;
 	}
-	ftruncate(f->fd[FCALL_STATE], 0);
-	lseek(f->fd[FCALL_STATE], 0, SEEK_SET);
-	dprintf(f->fd[FCALL_STATE], "none\n");
 
-	/* Cancel Tx side of the call */
-	free(f->av.frame);
-	f->av.frame = NULL;
-	fiforeset(f->dirfd, &f->fd[FCALL_IN], ffiles[FCALL_IN]);
+	if (!tox_file_get_file_id(tox, f->num, fnum, id, NULL))
+		memset(id, 0, sizeof(id));
+
+	/* Continue a receive that was cut off, skipping what we have */
+	for (i = 0; i < MAXTRANSFERS; i++) {
+		t = &f->rx[i];
+		if (t->state != TRANSFER_SUSPENDED || t->size != fsz ||
+		    memcmp(t->id, id, sizeof(id)))
+			continue;
+		t->fnum = fnum;
+		if (!tox_file_seek(tox, f->num, fnum, t->pos, NULL) ||
+		    !tox_file_control(tox, f->num, fnum, TOX_FILE_CONTROL_RESUME, NULL)) {
+			weprintf("Failed to resume Rx transfer\n");
+			cancelrxtransfer(t);
+			return;
+		}
+		t->state = TRANSFER_INPROGRESS;
+		friendwatch(f);
+		logmsg(": %s : %s > Resumed %s at %llu\n", f->name, t->tag, filename,
+		       (unsigned long long)t->pos);
+		return;
+	}
+
+	for (i = 0; i < MAXTRANSFERS && f->rx[i].state != TRANSFER_NONE; i++)
+		;
+	if (i == MAXTRANSFERS) {
+		logmsg(": %s : Rx > Rejected %s, already %d in progress\n",
+		       f->name, filename, MAXTRANSFERS);
+		if (!tox_file_control(tox, f->num, fnum, TOX_FILE_CONTROL_CANCEL, NULL))
+			weprintf("Failed to kill new Rx transfer\n");
+		return;
+	}
+	t = &f->rx[i];
+	t->fnum = fnum;
+	memcpy(t->id, id, sizeof(id));
+	t->size = fsz;
+	t->pos = 0;
+	statsreset(t);
+
+	if (savefriendfile(t, (char *)filename) == 0)
+		return;
+
+	fd = fifoopen(f->dirfd, t->pending);
+	dprintf(fd, "%s\n", filename);
+	close(fd);
+	t->state = TRANSFER_PENDING;
+	friendwatch(f);
+	logmsg(": %s : %s > Pending %s\n", f->name, t->tag, filename);
 }
 
 static void
-cancelcall(struct friend *f, char *action)
+cbfiledata(Tox *m, uint32_t frnum, uint32_t fnum, uint64_t pos,
+	   const uint8_t *data, size_t len, void *udata)
 {
-	logmsg(": %s : Audio > %s\n", f->name, action);
+	struct friend *f;
+	struct transfer *t;
+	ssize_t n;
 
-	if (f->av.state & TRANSMITTING || f->av.state & RINGING) {
-		if (!toxav_call_control(toxav, f->num, TOXAV_CALL_CONTROL_CANCEL, NULL))
-			weprintf("Failed to terminate call\n");
+	f = friendget(frnum);
+	if (!f || !(t = transferget(f->rx, fnum)))
+		return;
+
+	if (len) {
+		t->st.bytes += len;
+		t->st.chunks++;
+		digestupdate(t, pos, data, len);
+	} else {
+		digestfinal(t);
+		digestcheck(t);
 	}
-	cleanupcall(f);
+
+	if (t->filefd >= 0) {
+		t->pos += len;
+		ringput(&t->ring, data, len);
+		if (len && t->ring.len < DISKBLOCK)
+			return;
+		if (storerxtransfer(t) < 0)
+			return;
+		if (!len) {
+			syncrxtransfer(t);
+			logmsg(": %s : %s > Complete\n", f->name, t->tag);
+			endrxtransfer(t);
+		}
+		return;
+	}
+
+	/* When length is 0, the transfer is finished */
+	if (!len) {
+		t->state = TRANSFER_FLUSHING;
+		throttlerxtransfer(t);
+		return;
+	}
+
+	/*
+	 * Never wait for a slow reader here, as that would stall every
+	 * other friend.  What file_out doesn't take right away is queued
+	 * until it is writable again, and the sender is paused while the
+	 * queue holds more than RXHIWAT bytes.
+	 */
+	if (!t->ring.len) {
+		do
+			n = write(t->fd, data, len);
+		while (n < 0 && errno == EINTR);
+		if (n < 0) {
+			if (errno != EWOULDBLOCK) {
+				cancelrxtransfer(t);
+				return;
+			}
+			n = 0;
+		}
+		t->pos += n;
+		data += n;
+		len -= n;
+	}
+	t->pos += len;
+	ringput(&t->ring, data, len);
+	throttlerxtransfer(t);
 }
 
 static void
-sendfriendcalldata(struct friend *f)
+flushrxtransfer(struct transfer *t)
 {
-	struct   timespec now, diff;
-	ssize_t  n;
-	TOXAV_ERR_SEND_FRAME err;
-
-	n = fiforead(f->dirfd, &f->fd[FCALL_IN], ffiles[FCALL_IN],
-		     f->av.frame + (f->av.state & INCOMPLETE ? f->av.n : 0),
-		     framesize * sizeof(int16_t) - (f->av.state & INCOMPLETE ? f->av.n : 0));
-	if (n == 0) {
-		f->av.state &= ~OUTGOING;
-		f->av.state &= ~INCOMPLETE;
+	if (ringwrite(&t->ring, t->fd) < 0) {
+		/* file_out lost its reader */
+		cancelrxtransfer(t);
 		return;
-	} else if (n < 0 || f->av.state & RINGING) {
-		/* discard data as long as the call is not established */
+	}
+	throttlerxtransfer(t);
+}
+
+/*
+ * Friends with a file_dir directory, or a link to one, in their
+ * directory get files saved there right away.  Returns -1 if the
+ * transfer should wait for a file_out reader instead.
+ */
+static int
+savefriendfile(struct transfer *t, const char *filename)
+{
+	struct friend *f = t->f;
+	struct statvfs vfs;
+	char   name[NAME_MAX - 3], path[NAME_MAX + 1], *p;
+	size_t i;
+	int    dfd, fd = -1, r;
+
+	dfd = openat(f->dirfd, "file_dir", O_RDONLY | O_DIRECTORY);
+	if (dfd < 0)
+		return -1;
+
+	/* the sender doesn't get to pick the directory */
+	snprintf(name, sizeof(name), "%s", filename);
+	for (p = name; *p; p++)
+		if (*p == '/')
+			*p = '_';
+	if (!strcmp(name, "") || !strcmp(name, ".") || !strcmp(name, ".."))
+		snprintf(name, sizeof(name), "%lu", (unsigned long)time(NULL));
+	for (i = 0; i < 100 && fd < 0; i++) {
+		if (i)
+			snprintf(path, sizeof(path), "%s.%zu", name, i);
+		else
+			snprintf(path, sizeof(path), "%s", name);
+		fd = openat(dfd, path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if (fd < 0 && errno != EEXIST)
+			break;
+	}
+	if (fd < 0) {
+		weprintf("Failed to create %s in file_dir:", name);
+		close(dfd);
+		return -1;
+	}
+	close(dfd);
+
+	/* the friend's word on the size isn't worth filling the disk for */
+	if (t->size != UINT64_MAX && fstatvfs(fd, &vfs) == 0 &&
+	    t->size <= (uint64_t)vfs.f_bavail * vfs.f_frsize &&
+	    (r = posix_fallocate(fd, 0, t->size))) {
+		errno = r;
+		weprintf("posix_fallocate %s:", path);
+	}
+
+	t->filefd = fd;
+	t->path = strdup(path);
+	if (!t->path)
+		eprintf("strdup:");
+	t->unsynced = 0;
+	ringinit(&t->ring, RXBUFSIZE);
+	t->state = TRANSFER_INPROGRESS;
+	friendwatch(f);
+	logmsg(": %s : %s > Saving %s\n", f->name, t->tag, path);
+	if (!tox_file_control(tox, f->num, t->fnum, TOX_FILE_CONTROL_RESUME, NULL)) {
+		weprintf("Failed to accept transfer from receiver\n");
+		cancelrxtransfer(t);
+	}
+	return 0;
+}
+
+/* Write the collected blocks to disk, syncing every SYNCBYTES */
+static int
+storerxtransfer(struct transfer *t)
+{
+	t->unsynced += t->ring.len;
+	if (ringpwrite(&t->ring, t->filefd, t->pos - t->ring.len) < 0) {
+		weprintf("Failed to write %s:", t->path);
+		cancelrxtransfer(t);
+		return -1;
+	}
+	if (t->unsynced >= SYNCBYTES)
+		syncrxtransfer(t);
+	return 0;
+}
+
+/*
+ * Nobody reads a saved file while it arrives, so once its data is on
+ * disk let it leave the page cache rather than push out everything else
+ */
+static void
+syncrxtransfer(struct transfer *t)
+{
+	if (fdatasync(t->filefd) < 0)
+		weprintf("fdatasync %s:", t->path);
+	posix_fadvise(t->filefd, 0, 0, POSIX_FADV_DONTNEED);
+	t->unsynced = 0;
+}
+
+/* Act on the fill level of the receive queue */
+static void
+throttlerxtransfer(struct transfer *t)
+{
+	struct friend *f = t->f;
+
+	watchwrite(&t->w, t->ring.len > 0);
+
+	if (t->state == TRANSFER_FLUSHING && !t->ring.len) {
+		logmsg(": %s : %s > Complete\n", f->name, t->tag);
+		endrxtransfer(t);
+	} else if (t->state == TRANSFER_INPROGRESS && t->ring.len >= RXHIWAT) {
+		if (!tox_file_control(tox, f->num, t->fnum, TOX_FILE_CONTROL_PAUSE, NULL)) {
+			weprintf("Failed to pause Rx transfer\n");
+		} else {
+			t->state = TRANSFER_PAUSED;
+			t->st.pauses++;
+		}
+	} else if (t->state == TRANSFER_PAUSED && t->ring.len <= RXLOWAT) {
+		if (!tox_file_control(tox, f->num, t->fnum, TOX_FILE_CONTROL_RESUME, NULL))
+			weprintf("Failed to resume Rx transfer\n");
+		else
+			t->state = TRANSFER_INPROGRESS;
+	}
+}
+
+/*
+ * Feed the digest the `len' bytes at `pos'.  It only covers a transfer
+ * read in one go from the start, a jump anywhere but back to the start
+ * spoils it.
+ */
+static void
+digestupdate(struct transfer *t, uint64_t pos, const uint8_t *data, size_t len)
+{
+	if (pos == 0) {
+		crypto_generichash_init(&t->hs, NULL, 0, sizeof(t->digest));
+		t->hashpos = 0;
+		t->digeststate = DIGEST_RUNNING;
+	}
+	if (t->digeststate != DIGEST_RUNNING)
 		return;
-	} else if (n == (framesize * sizeof(int16_t) - (f->av.state & INCOMPLETE ? f->av.n : 0))) {
-		f->av.state &= ~INCOMPLETE;
-		f->av.n = 0;
-	} else {
-		f->av.state |= INCOMPLETE;
-		f->av.n += n;
+	if (pos != t->hashpos) {
+		t->digeststate = DIGEST_NONE;
 		return;
 	}
+	crypto_generichash_update(&t->hs, data, len);
+	t->hashpos += len;
+}
 
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	diff = timediff(f->av.lastsent, now);
-	if (diff.tv_sec == 0 && diff.tv_nsec < (AUDIOFRAME - 1) * 1E6) {
-		diff.tv_nsec = (AUDIOFRAME - 1) * 1E6 - diff.tv_nsec;
-		nanosleep(&diff, NULL);
+static void
+digestfinal(struct transfer *t)
+{
+	if (t->digeststate != DIGEST_RUNNING)
+		return;
+	if (t->size != UINT64_MAX && t->hashpos != t->size) {
+		t->digeststate = DIGEST_NONE;
+		return;
 	}
-	clock_gettime(CLOCK_MONOTONIC, &f->av.lastsent);
-	if (!toxav_audio_send_frame(toxav, f->num, (int16_t *)f->av.frame,
-	                            framesize, AUDIOCHANNELS, AUDIOSAMPLERATE, &err))
-		weprintf("Failed to send audio frame: %s\n", callerr[err]);
+	crypto_generichash_final(&t->hs, t->digest, sizeof(t->digest));
+	t->digeststate = DIGEST_DONE;
 }
 
+/* Compare a receive with what the sender hashed, once both are known */
 static void
-writemembers(struct conference *c)
+digestcheck(struct transfer *t)
 {
-	size_t i;
-	uint32_t peers, pnum;
-	uint8_t name[TOX_MAX_NAME_LENGTH + 1];
-	TOX_ERR_CONFERENCE_PEER_QUERY err;
+	if (t->digeststate != DIGEST_DONE || !t->havepeerdigest)
+		return;
+	if (!sodium_memcmp(t->digest, t->peerdigest, sizeof(t->digest)))
+		logmsg(": %s : %s > Verified\n", t->f->name, t->tag);
+	else
+		logmsg(": %s : %s > Digest mismatch\n", t->f->name, t->tag);
+	statswrite(t);
+}
 
-	/*The peer list is written when we invite the members by the callback*/
-	ftruncate(c->fd[CMEMBERS], 0);
-	peers = tox_conference_peer_count(tox, c->num, &err);
+static void
+senddigest(struct transfer *t)
+{
+	uint8_t pkt[1 + TOX_FILE_ID_LENGTH + crypto_generichash_BYTES];
 
-	if (err != TOX_ERR_CONFERENCE_PEER_QUERY_OK) {
-		weprintf("Unable to obtain peer count for conference %d\n", c->num);
+	if (t->pos != t->hashpos)
+		t->digeststate = DIGEST_NONE;
+	digestfinal(t);
+	if (t->digeststate != DIGEST_DONE)
 		return;
+	pkt[0] = PKTFILEDIGEST;
+	memcpy(pkt + 1, t->id, TOX_FILE_ID_LENGTH);
+	memcpy(pkt + 1 + TOX_FILE_ID_LENGTH, t->digest, sizeof(t->digest));
+	if (!tox_friend_send_lossless_packet(tox, t->f->num, pkt, sizeof(pkt), NULL))
+		weprintf("Failed to send digest for %s\n", t->tag);
+}
+
+static void
+statsreset(struct transfer *t)
+{
+	memset(&t->st, 0, sizeof(t->st));
+	t->st.sampled = mstime();
+	t->digeststate = DIGEST_NONE;
+	t->havepeerdigest = 0;
+	statswrite(t);
+}
+
+/* Take a sample of the counters and put them in the stats file */
+static void
+statswrite(struct transfer *t)
+{
+	struct stats *st = &t->st;
+	uint64_t now, rate, queued;
+	char     hex[2 * crypto_generichash_BYTES + 1];
+	int      fd;
+
+	now = mstime();
+	if (now > st->sampled) {
+		rate = (st->bytes - st->mark) * 1000 / (now - st->sampled);
+		st->rate = st->mark ? (st->rate * 3 + rate) / 4 : rate;
+		if (st->bytes == st->mark)
+			st->stalled += now - st->sampled;
+		else
+			st->stalled = 0;
+		st->mark = st->bytes;
+		st->sampled = now;
 	}
-	for (pnum = 0; pnum < peers; pnum++) {
-		if (!tox_conference_peer_get_name(tox, c->num, pnum, name, NULL)) {
-			weprintf("Unable to obtain the name for peer %d\n", pnum);
+
+	fd = fifoopen(t->f->dirfd, t->stats);
+	/* what toxcore asked for and didn't get yet, or what file_out didn't take */
+	queued = t->w.out ? t->ring.len : t->reqend - MIN(t->pos, t->reqend);
+	dprintf(fd, "bytes %llu\nrate %llu\nchunks %llu\npauses %llu\n"
+	        "retries %llu\nthrottled %llu\nqueued %llu\nstalled %llu\n",
+	        (unsigned long long)st->bytes, (unsigned long long)st->rate,
+	        (unsigned long long)st->chunks, (unsigned long long)st->pauses,
+	        (unsigned long long)st->retries, (unsigned long long)st->throttled,
+	        (unsigned long long)queued, (unsigned long long)st->stalled);
+	if (t->digeststate == DIGEST_DONE) {
+		id2str(t->digest, hex);
+		dprintf(fd, "digest %s\n", hex);
+	}
+	if (t->w.out)
+		dprintf(fd, "verified %s\n",
+		        t->digeststate != DIGEST_DONE || !t->havepeerdigest ? "unknown" :
+		        !sodium_memcmp(t->digest, t->peerdigest, sizeof(t->digest)) ? "yes" : "no");
+}
+
+static void
+endtxtransfer(struct transfer *t)
+{
+	statswrite(t);
+	t->fnum = -1;
+	t->state = TRANSFER_NONE;
+	ringfree(&t->ring);
+	if (t->filefd >= 0) {
+		if (t->share) {
+			TAILQ_REMOVE(&t->share->users, t, sentry);
+			shareput(t->share);
 		} else {
-			i = tox_conference_peer_get_name_size(tox, c->num, pnum, NULL);
-			name[i] = '\0';
-			dprintf(c->fd[CMEMBERS], "%s\n", name);
+			close(t->filefd);
 		}
+		t->share = NULL;
+		t->filefd = -1;
+		free(t->path);
+		t->path = NULL;
+		resumesave();
+	} else {
+		watchclose(&t->w);
+		fifomake(t->f->dirfd, t->fifo);
 	}
+	friendwatch(t->f);
 }
 
 static void
-cbconnstatus(Tox *m, uint32_t frnum, TOX_CONNECTION status, void *udata)
+endrxtransfer(struct transfer *t)
 {
-	struct friend *f;
-	struct request *req, *rtmp;
-	size_t r;
-	char   name[TOX_MAX_NAME_LENGTH + 1];
-	TOX_ERR_FRIEND_QUERY err;
+	statswrite(t);
+	if (t->filefd >= 0) {
+		/*
+		 * keep what arrived of a cancelled file, but not the rest
+		 * of the preallocated size, or it would look complete
+		 */
+		ringpwrite(&t->ring, t->filefd, t->pos - t->ring.len);
+		if (ftruncate(t->filefd, t->pos) < 0)
+			weprintf("ftruncate %s:", t->path);
+		close(t->filefd);
+		t->filefd = -1;
+		free(t->path);
+		t->path = NULL;
+	}
+	watchclose(&t->w);
+	ringfree(&t->ring);
+	/* opening empties it */
+	close(fifoopen(t->f->dirfd, t->pending));
+	t->state = TRANSFER_NONE;
+	friendwatch(t->f);
+}
 
-	r = tox_friend_get_name_size(tox, frnum, &err);
-	if (err != TOX_ERR_FRIEND_QUERY_OK) {
-		weprintf("Failed to get name for friend number %ld\n", (long)frnum);
+static void
+canceltxtransfer(struct transfer *t)
+{
+	if (t->state == TRANSFER_NONE)
 		return;
-	} else if (r == 0) {
-		snprintf(name, sizeof(name), "Anonymous");
-	} else {
-		tox_friend_get_name(tox, frnum, (uint8_t *)name, NULL);
-		name[r] = '\0';
+	logmsg(": %s : %s > Cancelling\n", t->f->name, t->tag);
+	if (t->state != TRANSFER_SUSPENDED &&
+	    !tox_file_control(tox, t->f->num, t->fnum, TOX_FILE_CONTROL_CANCEL, NULL))
+		weprintf("Failed to kill Tx transfer\n");
+	endtxtransfer(t);
+}
+
+static void
+cancelrxtransfer(struct transfer *t)
+{
+	if (t->state == TRANSFER_NONE)
+		return;
+	logmsg(": %s : %s > Cancelling\n", t->f->name, t->tag);
+	if (t->state != TRANSFER_FLUSHING && t->state != TRANSFER_SUSPENDED &&
+	    !tox_file_control(tox, t->f->num, t->fnum, TOX_FILE_CONTROL_CANCEL, NULL))
+		weprintf("Failed to kill Rx transfer\n");
+	endrxtransfer(t);
+}
+
+static void
+canceltransfers(struct friend *f)
+{
+	size_t i;
+
+	for (i = 0; i < MAXTRANSFERS; i++) {
+		canceltxtransfer(&f->tx[i]);
+		cancelrxtransfer(&f->rx[i]);
 	}
+}
 
-	logmsg(": %s : Connection > %s\n", name, status == TOX_CONNECTION_NONE ? "Offline" : "Online");
+/*
+ * The friend is gone, and toxcore with it forgot about all transfers.
+ * Sends by path and receives of a known size are kept to be continued,
+ * streams can't be and are cancelled, and so are receives the friend
+ * didn't offer again since the last time it went offline.
+ */
+static void
+suspendtransfers(struct friend *f)
+{
+	struct transfer *t;
+	size_t i;
 
-	TAILQ_FOREACH(f, &friendhead, entry) {
-		if (f->num == frnum) {
-			ftruncate(f->fd[FONLINE], 0);
-			lseek(f->fd[FONLINE], 0, SEEK_SET);
-			dprintf(f->fd[FONLINE], "%d\n", status);
-			break;
+	for (i = 0; i < MAXTRANSFERS; i++) {
+		t = &f->tx[i];
+		if (t->filefd >= 0 && t->state != TRANSFER_SUSPENDED) {
+			logmsg(": %s : %s > Suspended\n", f->name, t->tag);
+			ringdrop(&t->ring, t->ring.len);
+			t->state = TRANSFER_SUSPENDED;
+		} else if (t->filefd < 0) {
+			canceltxtransfer(t);
+		}
+
+		t = &f->rx[i];
+		if ((t->state == TRANSFER_INPROGRESS || t->state == TRANSFER_PAUSED) &&
+		    t->size != UINT64_MAX) {
+			logmsg(": %s : %s > Suspended\n", f->name, t->tag);
+			t->state = TRANSFER_SUSPENDED;
+			t->expires = 0;
+		} else if (t->state != TRANSFER_FLUSHING) {
+			cancelrxtransfer(t);
 		}
 	}
+	friendwatch(f);
+}
 
-	/* Remove the pending request-FIFO if it exists */
-	for (req = TAILQ_FIRST(&reqhead); req; req = rtmp) {
-		rtmp = TAILQ_NEXT(req, entry);
+/*
+ * Offer suspended sends again, the receiver decides where to go on.
+ * Suspended receives wait RESUMEDELAY seconds for the friend to do the
+ * same.
+ */
+static void
+resumetransfers(struct friend *f)
+{
+	size_t i;
+
+	for (i = 0; i < MAXTRANSFERS; i++) {
+		if (f->tx[i].state == TRANSFER_SUSPENDED)
+			resumetxtransfer(&f->tx[i]);
+		if (f->rx[i].state == TRANSFER_SUSPENDED && !f->rx[i].expires)
+			f->rx[i].expires = mstime() + RESUMEDELAY * 1000;
+	}
+	friendwatch(f);
+}
+
+/*
+ * Cancel suspended receives the friend didn't offer again in time, and
+ * retry offers of sends toxcore turned down every RESUMEDELAY seconds
+ */
+static void
+expiretransfers(struct friend *f)
+{
+	struct transfer *t;
+	size_t i;
+
+	if (f->conn == TOX_CONNECTION_NONE)
+		return;
+	for (i = 0; i < MAXTRANSFERS; i++) {
+		t = &f->tx[i];
+		if (t->state == TRANSFER_SUSPENDED && mstime() >= t->expires)
+			resumetxtransfer(t);
+
+		t = &f->rx[i];
+		if (t->state == TRANSFER_SUSPENDED && mstime() >= t->expires) {
+			logmsg(": %s : %s > Not offered again\n", f->name, t->tag);
+			cancelrxtransfer(t);
+		}
+	}
+}
+
+static void
+resumetxtransfer(struct transfer *t)
+{
+	char *name;
+
+	name = strrchr(t->path, '/') ? strrchr(t->path, '/') + 1 : t->path;
+	t->fnum = tox_file_send(tox, t->f->num, TOX_FILE_KIND_DATA, t->size, t->id,
+	                        (uint8_t *)name, MIN(strlen(name), TOX_MAX_FILENAME_LENGTH), NULL);
+	if (t->fnum == UINT32_MAX) {
+		weprintf("Failed to offer %s\n", t->path);
+		t->expires = mstime() + RESUMEDELAY * 1000;
+		return;
+	}
+	if (!t->share && lseek(t->filefd, 0, SEEK_SET) < 0) {
+		weprintf("lseek %s:", t->path);
+		canceltxtransfer(t);
+		return;
+	}
+	t->pos = 0;
+	t->reqend = 0;
+	t->reqlen = 0;
+	t->eof = 0;
+	t->state = TRANSFER_INITIATED;
+	logmsg(": %s : %s > Initiated %s\n", t->f->name, t->tag, name);
+}
+
+static void
+sendfriendtext(struct friend *f)
+{
+	ssize_t n;
+	time_t  t;
+	char buft[64];
+	uint8_t buf[TOX_MAX_MESSAGE_LENGTH + 1];
+	TOX_ERR_FRIEND_SEND_MESSAGE err;
+
+	n = fiforead(f->dirfd, &f->fd[FTEXT_IN], ffiles[FTEXT_IN], buf, sizeof(buf) - 1);
+	if (n <= 0)
+		return;
+	if (buf[n - 1] == '\n' && n > 1)
+		n--;
+	tox_friend_send_message(tox, f->num, TOX_MESSAGE_TYPE_NORMAL, buf, n, &err);
+	if (err != TOX_ERR_FRIEND_SEND_MESSAGE_OK)
+		weprintf("Failed to send message\n");
+
+	buf[n]='\0';
+	t = time(NULL);
+	strftime(buft, sizeof(buft), "%F %R", localtime(&t));
+	dprintf(f->fd[FTEXT_OUT], "me %s %s\n", buft, buf);
+}
+
+static void
+sendfriendfile(struct transfer *t)
+{
+	struct friend *f = t->f;
+	char tstamp[64];
 
-		if (memcmp(f->id, req->id, TOX_PUBLIC_KEY_SIZE))
-			continue;
-		unlinkat(gslots[REQUEST].fd[OUT], req->idstr, 0);
-		close(req->fd);
-		TAILQ_REMOVE(&reqhead, req, entry);
-		free(req->msg);
-		free(req);
+	if (t->state != TRANSFER_NONE)
+		return;
+	/* Prepare a new transfer */
+	snprintf(tstamp, sizeof(tstamp), "%lu", (unsigned long)time(NULL));
+	t->fnum = tox_file_send(tox, f->num, TOX_FILE_KIND_DATA, UINT64_MAX,
+				NULL, (uint8_t *)tstamp, strlen(tstamp), NULL);
+	if (t->fnum == UINT32_MAX) {
+		weprintf("Failed to initiate new transfer\n");
+		watchclose(&t->w);
+		fifomake(f->dirfd, t->fifo);
+		friendwatch(f);
+	} else {
+		if (!tox_file_get_file_id(tox, f->num, t->fnum, t->id, NULL))
+			memset(t->id, 0, sizeof(t->id));
+		/* start reading ahead while the friend decides */
+		ringinit(&t->ring, TXBUFSIZE);
+		t->size = UINT64_MAX;
+		t->pos = 0;
+		t->reqend = 0;
+		t->reqlen = 0;
+		t->eof = 0;
+		t->state = TRANSFER_INITIATED;
+		statsreset(t);
+		friendwatch(f);
+		logmsg(": %s : %s > Initiated\n", f->name, t->tag);
 	}
 }
 
+/*
+ * Send the files named in file_path, one per line, with their real
+ * size and name.  They are read directly instead of through a FIFO.
+ * A line may take several reads; the writer closing ends the last one.
+ */
 static void
-cbfriendmessage(Tox *m, uint32_t frnum, TOX_MESSAGE_TYPE type, const uint8_t *data, size_t len, void *udata)
+sendfriendpath(struct friend *f)
 {
-	struct  friend *f;
-	time_t  t;
-	uint8_t msg[len + 1];
-	char    buft[64];
+	if (linesread(&f->paths, f->dirfd, &f->fd[FFILE_PATH], ffiles[FFILE_PATH]) < 0)
+		return;
+	offerpaths(f);
+}
 
-	memcpy(msg, data, len);
-	msg[len] = '\0';
+/*
+ * Offer the paths read from file_path while there are free send
+ * slots.  The rest wait in the buffer, and file_path isn't read,
+ * until the loop calls again after slots free up.
+ */
+static void
+offerpaths(struct friend *f)
+{
+	char  *path;
+	size_t i;
+	int    offered = 0;
 
-	TAILQ_FOREACH(f, &friendhead, entry) {
-		if (f->num == frnum) {
-			t = time(NULL);
-			strftime(buft, sizeof(buft), "%F %R", localtime(&t));
-			dprintf(f->fd[FTEXT_OUT], "%s %s\n", buft, msg);
-			if (friendmsg_log)
-				logmsg(": %s > %s\n", f->name, msg);
+	for (;;) {
+		for (i = 0; i < MAXTRANSFERS && f->tx[i].state != TRANSFER_NONE; i++)
+			;
+		if (i == MAXTRANSFERS || !(path = linesnext(&f->paths)))
 			break;
-		}
+		if (*path && offerfile(f, path, NULL) == 0)
+			offered = 1;
 	}
+	if (offered)
+		resumesave();
+	friendwatch(f);
 }
 
-static void
-cbfriendrequest(Tox *m, const uint8_t *id, const uint8_t *data, size_t len, void *udata)
+/*
+ * Open the regular file at `path' for sending.  It is opened without
+ * blocking so that a FIFO without a writer can't hang the loop.
+ */
+static int
+openregular(char *path, struct stat *st)
 {
-	struct file reqfifo;
-	struct request *req;
-
-	req = calloc(1, sizeof(*req));
-	if (!req)
-		eprintf("calloc:");
-	req->fd = -1;
-
-	memcpy(req->id, id, TOX_PUBLIC_KEY_SIZE);
-	id2str(req->id, req->idstr);
+	int fd;
 
-	if (len > 0) {
-		req->msg = malloc(len + 1);
-		if (!req->msg)
-			eprintf("malloc:");
-		memcpy(req->msg, data, len);
-		req->msg[len] = '\0';
-	} else {
-		req->msg = "ratox is awesome!";
+	fd = open(path, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		weprintf("open %s:", path);
+		return -1;
 	}
+	if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode)) {
+		weprintf("%s: Not a regular file\n", path);
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	/* files are read front to back, ask for a larger readahead */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	return fd;
+}
 
-	reqfifo.name = req->idstr;
-	reqfifo.flags = O_RDONLY | O_NONBLOCK;
-	fiforeset(gslots[REQUEST].fd[OUT], &req->fd, reqfifo);
-
-	TAILQ_INSERT_TAIL(&reqhead, req, entry);
+/*
+ * Take a free send slot for the file at `path', identified by `id' if
+ * it was offered before, and offer it if the friend is online
+ */
+static int
+offerfile(struct friend *f, char *path, uint8_t *id)
+{
+	struct transfer *t;
+	struct stat st;
+	size_t i, n;
+	int    fd;
+
+	/* leave a slot whose file_in is open to its writers */
+	for (i = 0, t = NULL; i < MAXTRANSFERS; i++) {
+		if (f->tx[i].state == TRANSFER_NONE && (!t || t->fd >= 0))
+			t = &f->tx[i];
+	}
+	if (!t) {
+		weprintf("No free transfer slot for %s\n", path);
+		return -1;
+	}
 
-	logmsg("Request > %s : %s\n",
-	       req->idstr, req->msg);
+	if ((fd = openregular(path, &st)) < 0)
+		return -1;
+	t->path = strdup(path);
+	if (!t->path)
+		eprintf("strdup:");
+	n = strlen(f->idstr);
+	t->spool = !strncmp(path, f->idstr, n) && !strncmp(path + n, "/spool/", 7);
+	if (id)
+		memcpy(t->id, id, sizeof(t->id));
+	else
+		randombytes_buf(t->id, sizeof(t->id));
+	t->size = st.st_size;
+	t->filefd = fd;
+	ringinit(&t->ring, TXBUFSIZE);
+	t->state = TRANSFER_SUSPENDED;
+	statsreset(t);
+	if (f->conn != TOX_CONNECTION_NONE)
+		resumetxtransfer(t);
+	return 0;
 }
 
+/*
+ * Offer the files in the friend's spool directory while there are
+ * free send slots.  Hidden files are skipped, so files can be copied
+ * in under a dot name and renamed once complete.
+ */
 static void
-cbnamechange(Tox *m, uint32_t frnum, const uint8_t *data, size_t len, void *user)
+spoolfriend(struct friend *f)
 {
-	struct  friend *f;
-	uint8_t name[len + 1];
-
-	memcpy(name, data, len);
-	name[len] = '\0';
+	struct dirent *ent;
+	struct stat st;
+	DIR   *d;
+	char   path[PATH_MAX];
+	size_t i, busy, n = 0;
+	int    fd;
+
+	if (f->conn == TOX_CONNECTION_NONE)
+		return;
+	for (i = 0, busy = 0; i < MAXTRANSFERS; i++)
+		busy += f->tx[i].state != TRANSFER_NONE;
+	if (busy == MAXTRANSFERS)
+		return;
 
-	TAILQ_FOREACH(f, &friendhead, entry) {
-		if (f->num == frnum) {
-			if (memcmp(f->name, name, len + 1) == 0)
+	/* nothing was added or renamed since everything was offered */
+	if (fstatat(f->dirfd, "spool", &st, 0) < 0 ||
+	    (st.st_mtim.tv_sec == f->spooltime.tv_sec &&
+	     st.st_mtim.tv_nsec == f->spooltime.tv_nsec))
+		return;
+	fd = openat(f->dirfd, "spool", O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return;
+	d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		return;
+	}
+	while (busy < MAXTRANSFERS && (ent = readdir(d))) {
+		if (ent->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/spool/%s", f->idstr, ent->d_name);
+		for (i = 0; i < MAXTRANSFERS; i++)
+			if (f->tx[i].path && !strcmp(f->tx[i].path, path))
 				break;
-			ftruncate(f->fd[FNAME], 0);
-			lseek(f->fd[FNAME], 0, SEEK_SET);
-			dprintf(f->fd[FNAME], "%s\n", name);
-			logmsg(": %s : Name > %s\n", f->name, name);
-			memcpy(f->name, name, len + 1);
-			break;
+		if (i < MAXTRANSFERS)
+			continue;
+		if (offerfile(f, path, NULL) == 0) {
+			logmsg(": %s : Tx > Spooled %s\n", f->name, ent->d_name);
+			busy++;
+			n++;
 		}
 	}
-	datasave();
+	/*
+	 * Skip the next scans until the directory changes, unless files
+	 * were left for a free slot or it changed within the last second,
+	 * as a file could have come in since then with the same mtime
+	 */
+	if (busy < MAXTRANSFERS && st.st_mtim.tv_sec < time(NULL) - 1)
+		f->spooltime = st.st_mtim;
+	else
+		memset(&f->spooltime, 0, sizeof(f->spooltime));
+	closedir(d);
+	if (n) {
+		resumesave();
+		friendwatch(f);
+	}
 }
 
+/* Sent spool files are removed */
 static void
-cbstatusmessage(Tox *m, uint32_t frnum, const uint8_t *data, size_t len, void *udata)
+spooldone(struct transfer *t)
 {
-	struct friend *f;
-	uint8_t status[len + 1];
-
-	memcpy(status, data, len);
-	status[len] = '\0';
+	if (t->spool && unlink(t->path) < 0)
+		weprintf("unlink %s:", t->path);
+}
 
-	TAILQ_FOREACH(f, &friendhead, entry) {
-		if (f->num == frnum) {
-			ftruncate(f->fd[FSTATUS], 0);
-			lseek(f->fd[FSTATUS], 0, SEEK_SET);
-			dprintf(f->fd[FSTATUS], "%s\n", status);
-			logmsg(": %s : Status > %s\n", f->name, status);
-			break;
-		}
-	}
-	datasave();
+static struct share *
+shareopen(char *path)
+{
+	struct share *sh;
+	struct stat st;
+	int    fd;
+
+	if ((fd = openregular(path, &st)) < 0)
+		return NULL;
+	sh = calloc(1, sizeof(*sh));
+	if (!sh)
+		eprintf("calloc:");
+	sh->path = strdup(path);
+	sh->buf = malloc(2 * SHAREBUFSIZE);
+	if (!sh->path || !sh->buf)
+		eprintf("malloc:");
+	sh->fd = fd;
+	randombytes_buf(sh->id, sizeof(sh->id));
+	sh->size = st.st_size;
+	sh->refs = 1;
+	TAILQ_INIT(&sh->users);
+	return sh;
 }
 
 static void
-cbfriendstate(Tox *m, uint32_t frnum, TOX_USER_STATUS state, void *udata)
+shareput(struct share *sh)
 {
-	struct friend *f;
-
-	if (state >= LEN(ustate)) {
-		weprintf("Received invalid user status: %d\n", state);
+	if (--sh->refs > 0)
 		return;
-	}
+	close(sh->fd);
+	free(sh->path);
+	free(sh->buf);
+	free(sh);
+}
 
-	TAILQ_FOREACH(f, &friendhead, entry) {
-		if (f->num == frnum) {
-			ftruncate(f->fd[FSTATE], 0);
-			lseek(f->fd[FSTATE], 0, SEEK_SET);
-			dprintf(f->fd[FSTATE], "%s\n", ustate[state]);
-			logmsg(": %s : State > %s\n", f->name, ustate[state]);
-			break;
+/* The `n' bytes at `pos', read into `tmp' if they are behind the window */
+static uint8_t *
+sharepeek(struct share *sh, uint64_t pos, size_t n, uint8_t *tmp)
+{
+	struct   transfer *t;
+	uint64_t base;
+	ssize_t  r;
+
+	if (pos >= sh->base && pos + n <= sh->base + sh->len)
+		return sh->buf + sh->off + (pos - sh->base);
+	if (pos < sh->base || n > SHAREBUFSIZE) {
+		do
+			r = pread(sh->fd, tmp, n, pos);
+		while (r < 0 && errno == EINTR);
+		if (r < 0)
+			return NULL;
+		if ((size_t)r < n) {
+			errno = EIO; /* the file got shorter */
+			return NULL;
 		}
+		return tmp;
 	}
-	datasave();
+
+	/* move the window up to the slowest friend that is still in it */
+	base = pos;
+	TAILQ_FOREACH(t, &sh->users, sentry)
+		if (t->state != TRANSFER_SUSPENDED && t->pos >= sh->base && t->pos < base)
+			base = t->pos;
+	if (pos + n > SHAREBUFSIZE)
+		base = MAX(base, pos + n - SHAREBUFSIZE);
+	if (base >= sh->base + sh->len) {
+		sh->off = 0;
+		sh->len = 0;
+	} else {
+		sh->off += base - sh->base;
+		sh->len -= base - sh->base;
+	}
+	sh->base = base;
+	if (sh->off > SHAREBUFSIZE) {
+		memmove(sh->buf, sh->buf + sh->off, sh->len);
+		sh->off = 0;
+	}
+
+	do
+		r = pread(sh->fd, sh->buf + sh->off + sh->len, SHAREBUFSIZE - sh->len,
+		          sh->base + sh->len);
+	while (r < 0 && errno == EINTR);
+	if (r < 0)
+		return NULL;
+	sh->len += r;
+	if (pos + n > sh->base + sh->len) {
+		errno = EIO;
+		return NULL;
+	}
+	return sh->buf + sh->off + (pos - sh->base);
 }
 
-static void
-cbfilecontrol(Tox *m, uint32_t frnum, uint32_t fnum, TOX_FILE_CONTROL ctrltype, void *udata)
+/* Like offerfile(), with the file read through `sh' */
+static int
+offershare(struct friend *f, struct share *sh)
 {
-	struct friend *f;
-
-	TAILQ_FOREACH(f, &friendhead, entry)
-		if (f->num == frnum)
-			break;
-	if (!f)
-		return;
+	struct transfer *t;
+	size_t i;
 
-	switch (ctrltype) {
-	case TOX_FILE_CONTROL_RESUME:
-		if (f->tx.state == TRANSFER_PAUSED) {
-			logmsg(": %s : Tx > Resumed\n", f->name);
-			f->tx.state = TRANSFER_INPROGRESS;
-		} else {
-			f->tx.fnum = fnum;
-			f->tx.buf = malloc(TOX_MAX_CUSTOM_PACKET_SIZE);
-			if (!f->tx.buf)
-				eprintf("malloc:");
-			f->tx.n = 0;
-			f->tx.pendingbuf = 0;
-			f->tx.state = TRANSFER_INPROGRESS;
-			logmsg(": %s : Tx > In Progress\n", f->name);
-		}
-		break;
-	case TOX_FILE_CONTROL_PAUSE:
-		if (f->tx.state == TRANSFER_INPROGRESS) {
-			logmsg(": %s : Tx > Paused\n", f->name);
-			f->tx.state = TRANSFER_PAUSED;
-		}
-		break;
-	case TOX_FILE_CONTROL_CANCEL:
-		/* Check wether we're sending or receiving */
-		if (f->tx.fnum == fnum) {
-			logmsg(": %s : Tx > Rejected\n", f->name);
-			f->tx.state = TRANSFER_NONE;
-			free(f->tx.buf);
-			f->tx.buf = NULL;
-			fiforeset(f->dirfd, &f->fd[FFILE_IN], ffiles[FFILE_IN]);
-		} else {
-			logmsg(": %s : Rx > Cancelled by Sender\n", f->name);
-			cancelrxtransfer(f);
-		}
-		break;
-	default:
-		weprintf("Unhandled file control type: %d\n", ctrltype);
-		break;
-	};
+	for (i = 0; i < MAXTRANSFERS && f->tx[i].state != TRANSFER_NONE; i++)
+		;
+	if (i == MAXTRANSFERS) {
+		weprintf("No free transfer slot for %s\n", sh->path);
+		return -1;
+	}
+	t = &f->tx[i];
+
+	t->path = strdup(sh->path);
+	if (!t->path)
+		eprintf("strdup:");
+	memcpy(t->id, sh->id, sizeof(t->id));
+	t->size = sh->size;
+	t->filefd = sh->fd;
+	t->share = sh;
+	t->spool = 0;
+	TAILQ_INSERT_TAIL(&sh->users, t, sentry);
+	sh->refs++;
+	t->state = TRANSFER_SUSPENDED;
+	statsreset(t);
+	if (f->conn != TOX_CONNECTION_NONE)
+		resumetxtransfer(t);
+	friendwatch(f);
+	return 0;
 }
 
 static void
-cbfiledatareq(Tox *m, uint32_t frnum, uint32_t fnum, uint64_t pos, size_t flen, void *udata)
+readfriendfile(struct transfer *t)
 {
-	struct friend *f;
 	ssize_t n;
 
-	TAILQ_FOREACH(f, &friendhead, entry)
-		if (f->num == frnum)
-			break;
-
-	/* Grab another buffer from the FIFO */
-	if (!f->tx.pendingbuf) {
-		n = fiforead(f->dirfd, &f->fd[FFILE_IN], ffiles[FFILE_IN],
-		             f->tx.buf, flen);
-		f->tx.n = n;
-		f->tx.pendingbuf = 0;
-	}
-
-	if (f->tx.n < 0) {
+	n = ringread(&t->ring, t->fd);
+	if (n < 0) {
 		if (errno != EWOULDBLOCK)
-			weprintf("Reading data for file sending would block\n");
-		return;
-	}
-
-	if (!tox_file_send_chunk(tox, f->num, f->tx.fnum, pos, f->tx.buf, f->tx.n, NULL))
-		f->tx.pendingbuf = 1;
-
-	/*
-	 * For streams, core will know that the transfer is finished
-	 * if a chunk with length less than the length requested in the
-	 * callback is sent.
-	 */
-	if (!f->tx.pendingbuf && (size_t)f->tx.n < flen) {
-		logmsg(": %s : Tx > Complete\n", f->name);
-		f->tx.state = TRANSFER_NONE;
-		f->tx.fnum = -1;
-		free(f->tx.buf);
-		f->tx.buf = NULL;
-		fiforeset(f->dirfd, &f->fd[FFILE_IN], ffiles[FFILE_IN]);
+			eprintf("read %s:", t->fifo.name);
 		return;
 	}
+	if (n == 0)
+		t->eof = 1;
+	if (t->state == TRANSFER_INPROGRESS)
+		sendfriendfiledata(t->f);
+	else
+		friendwatch(t->f);
 }
 
+/* Add the tokens for the time since the last refill */
 static void
-cbfilesendreq(Tox *m, uint32_t frnum, uint32_t fnum, uint32_t kind, uint64_t fsz,
-	      const uint8_t *fname, size_t flen, void *udata)
+bucketfill(struct bucket *b, uint64_t rate)
 {
-	struct  friend *f;
-	uint8_t filename[flen + 1];
+	uint64_t now, burst;
 
-	TAILQ_FOREACH(f, &friendhead, entry)
-		if (f->num == frnum)
-			break;
-	if (!f)
-		return;
+	/* allow a tenth of a second worth of bytes at once */
+	burst = MAX(rate / 10, TOX_MAX_CUSTOM_PACKET_SIZE) * 1000;
+	now = mstime();
+	b->tokens = MIN(burst, b->tokens + (now - b->last) * rate);
+	b->last = now;
+}
 
-	memcpy(filename, fname, flen);
-	filename[flen] = '\0';
+/*
+ * Take tokens for `n' bytes of file data from the global bucket, and
+ * from the friend's own while a call to it is up, so bulk transfers
+ * leave room for the audio.  Returns 0 if either bucket runs dry.
+ */
+static int
+filetokens(struct friend *f, size_t n)
+{
+	int call = FILECALLRATE && (f->av.state & TRANSMITTING);
 
-	if (kind == TOX_FILE_KIND_AVATAR) {
-		if (!tox_file_control(tox, f->num, fnum, TOX_FILE_CONTROL_CANCEL, NULL))
-			weprintf("Failed to kill avatar transfer\n");
-		return;
+	if (FILERATE) {
+		bucketfill(&filebucket, FILERATE);
+		if (filebucket.tokens < n * 1000)
+			return 0;
 	}
-
-	/* We only support a single transfer at a time */
-	if (f->rxstate == TRANSFER_INPROGRESS) {
-		logmsg(": %s : Rx > Rejected %s, already one in progress\n",
-		       f->name, filename);
-		if (!tox_file_control(tox, f->num, f->tx.fnum, TOX_FILE_CONTROL_CANCEL, NULL))
-			weprintf("Failed to kill new Rx transfer\n");
-		return;
+	if (call) {
+		bucketfill(&f->bucket, FILECALLRATE);
+		if (f->bucket.tokens < n * 1000)
+			return 0;
+		f->bucket.tokens -= n * 1000;
 	}
-
-	f->tx.fnum = fnum;
-
-	ftruncate(f->fd[FFILE_STATE], 0);
-	lseek(f->fd[FFILE_STATE], 0, SEEK_SET);
-	dprintf(f->fd[FFILE_STATE], "%s\n", filename);
-	f->rxstate = TRANSFER_PENDING;
-	logmsg(": %s : Rx > Pending %s\n", f->name, filename);
+	if (FILERATE)
+		filebucket.tokens -= n * 1000;
+	return 1;
 }
 
-static void
-cbfiledata(Tox *m, uint32_t frnum, uint32_t fnum, uint64_t pos,
-	   const uint8_t *data, size_t len, void *udata)
+/*
+ * Send the next chunk toxcore asked for.  Returns 1 if a chunk was
+ * sent, -1 if toxcore's send queue is full or the rate caps hold it
+ * back, 0 if there is nothing to send.
+ */
+static int
+sendfilechunk(struct transfer *t)
 {
-	struct   friend *f;
-	ssize_t  n;
-	uint16_t wrote = 0;
-
-	TAILQ_FOREACH(f, &friendhead, entry)
-		if (f->num == frnum)
-			break;
-	if (!f)
-		return;
+	uint8_t  tmp[TOX_MAX_CUSTOM_PACKET_SIZE], *p;
+	size_t   n;
+	TOX_ERR_FILE_SEND_CHUNK err;
 
-	/* When length is 0, the transfer is finished */
-	if (!len) {
-		logmsg(": %s : Rx > Complete\n", f->name);
-		if (f->fd[FFILE_OUT] != -1) {
-			close(f->fd[FFILE_OUT]);
-			f->fd[FFILE_OUT] = -1;
+	if (t->state != TRANSFER_INPROGRESS || t->pos >= t->reqend)
+		return 0;
+	n = MIN(t->reqlen, t->reqend - t->pos);
+	if (t->share) {
+		n = MIN(n, t->size - t->pos);
+		p = sharepeek(t->share, t->pos, n, tmp);
+		if (!p) {
+			weprintf("Failed to read file for %s:", t->tag);
+			canceltxtransfer(t);
+			return 0;
 		}
-		ftruncate(f->fd[FFILE_STATE], 0);
-		lseek(f->fd[FFILE_STATE], 0, SEEK_SET);
-		f->rxstate = TRANSFER_NONE;
-		return;
+		goto send;
 	}
-
-	while (len > 0) {
-		n = write(f->fd[FFILE_OUT], &data[wrote], len);
-		if (n < 0) {
-			if (errno == EPIPE) {
-				cancelrxtransfer(f);
-				break;
-			} else if (errno == EWOULDBLOCK) {
-				continue;
-			}
+	if (t->ring.len < n && !t->eof && t->filefd >= 0) {
+		if (ringread(&t->ring, t->filefd) < 0) {
+			weprintf("Failed to read file for %s:", t->tag);
+			canceltxtransfer(t);
+			return 0;
 		}
-		wrote += n;
-		len -= n;
+		/* regular files only come up short at their end */
+		if (t->ring.len < n)
+			t->eof = 1;
 	}
+	if (t->ring.len < n && !t->eof)
+		return 0;
+	if (t->ring.len < n && t->size != UINT64_MAX) {
+		weprintf("%s: File shrank while sending\n", t->path);
+		canceltxtransfer(t);
+		return 0;
+	}
+	/*
+	 * For streams, core will know that the transfer is finished
+	 * if a chunk with length less than the length requested in the
+	 * callback is sent.
+	 */
+	n = MIN(n, t->ring.len);
+	p = ringpeek(&t->ring, tmp, n);
+send:
+	if (!filetokens(t->f, n)) {
+		t->st.throttled++;
+		return -1;
+	}
+	if (!tox_file_send_chunk(tox, t->f->num, t->fnum, t->pos, p, n, &err)) {
+		if (err == TOX_ERR_FILE_SEND_CHUNK_SENDQ) {
+			t->st.retries++;
+			return -1;
+		}
+		weprintf("Failed to send file chunk\n");
+		canceltxtransfer(t);
+		return 0;
+	}
+	if (!t->share)
+		ringdrop(&t->ring, n);
+	digestupdate(t, t->pos, p, n);
+	t->pos += n;
+	t->st.bytes += n;
+	t->st.chunks++;
+	/* sized sends complete on the friend's zero-length request */
+	if (n < t->reqlen && t->size == UINT64_MAX) {
+		logmsg(": %s : %s > Complete\n", t->f->name, t->tag);
+		senddigest(t);
+		spooldone(t);
+		endtxtransfer(t);
+	}
+	return 1;
 }
 
+/*
+ * Hand toxcore the requested chunks that were read ahead, taking
+ * one chunk from each transfer in turn.  When the send queue fills
+ * up, the transfer that got turned away goes first on the retry.
+ */
 static void
-canceltxtransfer(struct friend *f)
-{
-	if (f->tx.state == TRANSFER_NONE)
-		return;
-	logmsg(": %s : Tx > Cancelling\n", f->name);
-	if (!tox_file_control(tox, f->num, f->tx.fnum, TOX_FILE_CONTROL_CANCEL, NULL))
-		weprintf("Failed to kill Tx transfer\n");
-	f->tx.fnum = -1;
-	f->tx.state = TRANSFER_NONE;
-	free(f->tx.buf);
-	f->tx.buf = NULL;
-	fiforeset(f->dirfd, &f->fd[FFILE_IN], ffiles[FFILE_IN]);
-}
-
-static void
-cancelrxtransfer(struct friend *f)
+sendfriendfiledata(struct friend *f)
 {
-	if (f->rxstate == TRANSFER_NONE)
-		return;
-	logmsg(": %s : Rx > Cancelling\n", f->name);
-	if (!tox_file_control(tox, f->num, f->tx.fnum, TOX_FILE_CONTROL_CANCEL, NULL))
-		weprintf("Failed to kill Rx transfer\n");
-	if (f->fd[FFILE_OUT] != -1) {
-		close(f->fd[FFILE_OUT]);
-		f->fd[FFILE_OUT] = -1;
-	}
-	ftruncate(f->fd[FFILE_STATE], 0);
-	lseek(f->fd[FFILE_STATE], 0, SEEK_SET);
-	f->rxstate = TRANSFER_NONE;
+	size_t i, j;
+	int    r, sent;
+
+	do {
+		sent = 0;
+		for (i = 0; i < MAXTRANSFERS; i++) {
+			j = (f->txnext + i) % MAXTRANSFERS;
+			r = sendfilechunk(&f->tx[j]);
+			if (r < 0) {
+				f->txnext = j;
+				friendwatch(f);
+				return;
+			}
+			sent += r;
+		}
+	} while (sent);
+	friendwatch(f);
 }
 
 static void
-sendfriendtext(struct friend *f)
+callfriend(struct friend *f)
 {
-	ssize_t n;
-	time_t  t;
-	char buft[64];
-	uint8_t buf[TOX_MAX_MESSAGE_LENGTH + 1];
-	TOX_ERR_FRIEND_SEND_MESSAGE err;
+	if (!f->av.state) {
+		if (callsetup(f) < 0) {
+			weprintf("Failed to call: %d calls running\n", MAXCALLS);
+			fiforeset(f->dirfd, &f->fd[FCALL_IN], ffiles[FCALL_IN]);
+			return;
+		}
+		if (!toxav_call(toxav, f->num, f->av.bitrate, VIDEOBITRATE, NULL)) {
+			weprintf("Failed to call\n");
+			callfree(f);
+			fiforeset(f->dirfd, &f->fd[FCALL_IN], ffiles[FCALL_IN]);
+			return;
+		}
 
-	n = fiforead(f->dirfd, &f->fd[FTEXT_IN], ffiles[FTEXT_IN], buf, sizeof(buf) - 1);
-	if (n <= 0)
+		f->av.state |= RINGING;
+		f->av.ringuntil = mstime() + RINGINGDELAY * 1000;
+		friendwatch(f);
+		logmsg(": %s : Audio > Tx Inviting\n", f->name);
+	}
+	if (!(f->av.state & OUTGOING)) {
+		f->av.n = 0;
+		f->av.nextsend = 0;
+		f->av.state |= OUTGOING;
 		return;
-	if (buf[n - 1] == '\n' && n > 1)
-		n--;
-	tox_friend_send_message(tox, f->num, TOX_MESSAGE_TYPE_NORMAL, buf, n, &err);
-	if (err != TOX_ERR_FRIEND_SEND_MESSAGE_OK)
-		weprintf("Failed to send message\n");
-
-	buf[n]='\0';
-	t = time(NULL);
-	strftime(buft, sizeof(buft), "%F %R", localtime(&t));
-	dprintf(f->fd[FTEXT_OUT], "me %s %s\n", buft, buf);
+	}
+	if (f->av.state & TRANSMITTING)
+		sendfriendcalldata(f);
 }
 
 static void
@@ -1121,24 +3977,30 @@ static void
 invitefriend(struct conference *c)
 {
 	ssize_t n;
-	char buf[2 * TOX_ADDRESS_SIZE + 1];
-	struct friend *f;
+	char buf[2 * TOX_ADDRESS_SIZE + 2];
+	uint8_t id[TOX_ADDRESS_SIZE];
+	struct friend *f = NULL;
+	struct peer *p;
 
-	n = fiforead(c->dirfd, &c->fd[CINVITE], cfiles[CINVITE], buf, sizeof(buf));
+	n = fiforead(c->dirfd, &c->fd[CINVITE], cfiles[CINVITE], buf, sizeof(buf) - 1);
 
-	if (n > sizeof(buf) || n <= 0)
+	if (n <= 0)
 		return;
+	buf[n] = '\0';
 	if (buf[n - 1] == '\n')
-		buf[n - 1] = '\0';
+		buf[--n] = '\0';
 
-	TAILQ_FOREACH(f, &friendhead, entry)
-		if (!memcmp(buf, f->idstr, sizeof(f->idstr)-1))
-			break;
+	/* The friend may be given by its public key or its full address */
+	if (n >= 2 * TOX_PUBLIC_KEY_SIZE) {
+		str2id(buf, id);
+		if ((p = peerget(id, 0)))
+			f = p->f;
+	}
 	if (!f) {
 		weprintf("No friend with id %s found for %s\n", buf, c->numstr);
 		return;
 	}
-	if (tox_friend_get_connection_status(tox, f->num, NULL) == TOX_CONNECTION_NONE) {
+	if (f->conn == TOX_CONNECTION_NONE) {
 		weprintf("%s not online, can't be invited to %s\n", buf, c->numstr);
 		return;
 	}
@@ -1195,6 +4057,14 @@ updatetitle(struct conference *c)
 	logmsg("- %s : Title > %s\n", c->numstr, title);
 }
 
+static void
+leaveconf(struct conference *c)
+{
+	logmsg("- %s > Leave\n", c->numstr);
+	tox_conference_delete(tox, c->num, NULL);
+	confdestroy(c);
+}
+
 static int
 readpass(const char *prompt, uint8_t **target, uint32_t *len)
 {
@@ -1357,6 +4227,7 @@ localinit(void)
 			eprintf("dirfd %s:", gslots[i].name);
 		gslots[i].dirfd = r;
 
+		watchinit(&gslots[i].w, &gslots[i].fd[IN], WSLOT, &gslots[i], IN);
 		for (m = 0; m < LEN(gfiles); m++) {
 			if (gfiles[m].type == FIFO) {
 				fiforeset(gslots[i].dirfd, &gslots[i].fd[m], gfiles[m]);
@@ -1372,6 +4243,7 @@ localinit(void)
 				gslots[i].fd[m] = r;
 			}
 		}
+		watchon(&gslots[i].w, 1);
 	}
 
 	/* Dump current name */
@@ -1446,8 +4318,6 @@ toxinit(void)
 	if (!toxav)
 		eprintf("Core : ToxAV > Initialization failed\n");
 
-	framesize = (AUDIOSAMPLERATE * AUDIOFRAME * AUDIOCHANNELS) / 1000;
-
 	tox_callback_friend_connection_status(tox, cbconnstatus);
 	tox_callback_friend_message(tox, cbfriendmessage);
 	tox_callback_friend_request(tox, cbfriendrequest);
@@ -1458,11 +4328,14 @@ toxinit(void)
 	tox_callback_file_recv(tox, cbfilesendreq);
 	tox_callback_file_recv_chunk(tox, cbfiledata);
 	tox_callback_file_chunk_request(tox, cbfiledatareq);
+	tox_callback_friend_lossless_packet(tox, cbfiledigest);
 
 	toxav_callback_call(toxav, cbcallinvite, NULL);
 	toxav_callback_call_state(toxav, cbcallstate, NULL);
 
 	toxav_callback_audio_receive_frame(toxav, cbcalldata, NULL);
+	toxav_callback_audio_bit_rate(toxav, cbcallbitrate, NULL);
+	toxav_callback_video_receive_frame(toxav, cbvideodata, NULL);
 
 	tox_callback_conference_invite(tox, cbconfinvite);
 	tox_callback_conference_message(tox, cbconfmessage);
@@ -1475,6 +4348,98 @@ toxinit(void)
 	return 0;
 }
 
+/*
+ * Runs toxav_iterate() and sends the frames queued by the loop, so a
+ * loop stalled on disk or the network doesn't hold up call audio.
+ */
+static void *
+avloop(void *arg)
+{
+	struct   sched_param sp;
+	struct   pollfd pfd;
+	struct   avframe *fr;
+	struct   vframe *vf;
+	uint64_t now, next = 0;
+	char     buf[64];
+	int      r;
+	TOXAV_ERR_SEND_FRAME err;
+
+	if (avpriority) {
+		sp.sched_priority = avpriority;
+		r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (r)
+			weprintf("pthread_setschedparam: %s\n", strerror(r));
+	}
+
+	pfd.fd = avpipe[0];
+	pfd.events = POLLIN;
+	while (!atomic_load(&avstop)) {
+		while ((fr = avqfront(&avtx))) {
+			if (!toxav_audio_send_frame(toxav, fr->fnum, fr->pcm, fr->len,
+			                            fr->channels, fr->rate, &err)) {
+				weprintf("Failed to send audio frame: %s\n", callerr[err]);
+				avreport(AVFAILED, fr->fnum, 0);
+			}
+			avqpop(&avtx);
+		}
+		while ((vf = avqfront(&vtx))) {
+			/* only a change is news to the loop */
+			err = sendvideo(vf->fnum, vf->yuv);
+			if ((err != TOXAV_ERR_SEND_FRAME_OK) != vf->failing)
+				avreport(AVVIDEO, vf->fnum, err);
+			avqpop(&vtx);
+		}
+		now = mstime();
+		if (now >= next) {
+			toxav_iterate(toxav);
+			next = now + toxav_iteration_interval(toxav);
+		}
+		now = mstime();
+		if (poll(&pfd, 1, next > now ? next - now : 0) > 0)
+			while (read(avpipe[0], buf, sizeof(buf)) > 0)
+				;
+	}
+	return NULL;
+}
+
+static void
+avinit(void)
+{
+	int r, i;
+
+	if (!avthread)
+		return;
+	if (avlock && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		weprintf("mlockall:");
+	avqinit(&avrx, AVQUEUE, sizeof(struct avframe));
+	avqinit(&avtx, AVQUEUE, sizeof(struct avframe));
+	avqinit(&vrx, VIDEOQUEUE, sizeof(struct vframe));
+	avqinit(&vtx, VIDEOQUEUE, sizeof(struct vframe));
+	if (pipe(avpipe) < 0)
+		eprintf("pipe:");
+	for (i = 0; i < 2; i++)
+		fcntl(avpipe[i], F_SETFL, fcntl(avpipe[i], F_GETFL) | O_NONBLOCK);
+	r = pthread_create(&avtid, NULL, avloop, NULL);
+	if (r)
+		eprintf("pthread_create: %s\n", strerror(r));
+}
+
+static void
+avshutdown(void)
+{
+	if (!avthread)
+		return;
+	atomic_store(&avstop, 1);
+	write(avpipe[1], "", 1);
+	pthread_join(avtid, NULL);
+	close(avpipe[0]);
+	close(avpipe[1]);
+	free(avrx.buf);
+	free(avtx.buf);
+	free(vrx.buf);
+	free(vtx.buf);
+}
+
 static int
 toxconnect(void)
 {
@@ -1535,6 +4500,151 @@ str2id(char *idstr, uint8_t *id)
 		sscanf(p, "%2hhx", &id[i]);
 }
 
+static void
+peerinit(void)
+{
+	if (sodium_init() < 0)
+		eprintf("sodium_init: Failed\n");
+	randombytes_buf(peerkey, sizeof(peerkey));
+}
+
+/* Keyed hash, as public keys are chosen by the remote side */
+static size_t
+peerhash(const uint8_t *id)
+{
+	uint64_t h;
+
+	crypto_shorthash((uint8_t *)&h, id, TOX_PUBLIC_KEY_SIZE, peerkey);
+	return h & (peertabsz - 1);
+}
+
+static struct peer *
+peerget(const uint8_t *id, int create)
+{
+	struct peerhead *tab;
+	struct peer *p;
+	size_t i, sz;
+
+	if (peertabsz) {
+		LIST_FOREACH(p, &peertab[peerhash(id)], entry)
+			if (!memcmp(p->id, id, TOX_PUBLIC_KEY_SIZE))
+				return p;
+	}
+	if (!create)
+		return NULL;
+
+	if (npeers >= peertabsz) {
+		/* Rehash into a table twice the size */
+		tab = peertab;
+		sz = peertabsz;
+		peertabsz = sz ? 2 * sz : 64;
+		peertab = calloc(peertabsz, sizeof(*peertab));
+		if (!peertab)
+			eprintf("calloc:");
+		for (i = 0; i < sz; i++) {
+			while ((p = LIST_FIRST(&tab[i]))) {
+				LIST_REMOVE(p, entry);
+				LIST_INSERT_HEAD(&peertab[peerhash(p->id)], p, entry);
+			}
+		}
+		free(tab);
+	}
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		eprintf("calloc:");
+	memcpy(p->id, id, TOX_PUBLIC_KEY_SIZE);
+	LIST_INIT(&p->invs);
+	LIST_INSERT_HEAD(&peertab[peerhash(id)], p, entry);
+	npeers++;
+	return p;
+}
+
+/* Drop a peer nothing refers to anymore */
+static void
+peerput(struct peer *p)
+{
+	if (!p || p->f || p->req || !LIST_EMPTY(&p->invs))
+		return;
+	LIST_REMOVE(p, entry);
+	free(p);
+	npeers--;
+}
+
+static struct friend *
+friendget(uint32_t frnum)
+{
+	return frnum < friendtabsz ? friendtab[frnum] : NULL;
+}
+
+static struct conference *
+confget(uint32_t cnum)
+{
+	return cnum < conftabsz ? conftab[cnum] : NULL;
+}
+
+/* The running transfer with file number `fnum' among the slots `t' */
+static struct transfer *
+transferget(struct transfer *t, uint32_t fnum)
+{
+	size_t i;
+
+	for (i = 0; i < MAXTRANSFERS; i++)
+		if (t[i].state != TRANSFER_NONE && t[i].fnum == fnum)
+			return &t[i];
+	return NULL;
+}
+
+static void
+transferinit(struct friend *f, struct transfer *t, int rx, size_t i)
+{
+	char sfx[16] = "";
+
+	if (i)
+		snprintf(sfx, sizeof(sfx), ".%d", (int)i);
+	snprintf(t->tag, sizeof(t->tag), "%s%s", rx ? "Rx" : "Tx", sfx);
+	t->f = f;
+	t->fnum = -1;
+	t->state = TRANSFER_NONE;
+
+	t->fifo = tfiles[rx ? TFILE_OUT : TFILE_IN];
+	snprintf(t->fifoname, sizeof(t->fifoname), "%s%s", t->fifo.name, sfx);
+	t->fifo.name = t->fifoname;
+	t->fd = -1;
+	t->filefd = -1;
+	watchinit(&t->w, &t->fd, WTRANSFER, t, i);
+	t->w.out = rx;
+	/* friendwatch() opens file_in once the slot is the next free one */
+	fifomake(f->dirfd, t->fifo);
+
+	/* stats and pending files are opened only to rewrite them */
+	t->stats = tfiles[rx ? TFILE_OUTSTATS : TFILE_INSTATS];
+	snprintf(t->statsname, sizeof(t->statsname), "%s%s", t->stats.name, sfx);
+	t->stats.name = t->statsname;
+	close(fifoopen(f->dirfd, t->stats));
+
+	if (rx) {
+		t->pending = tfiles[TFILE_STATE];
+		snprintf(t->pendingname, sizeof(t->pendingname), "%s%s", t->pending.name, sfx);
+		t->pending.name = t->pendingname;
+		close(fifoopen(f->dirfd, t->pending));
+	}
+}
+
+static void
+transferdestroy(struct transfer *t)
+{
+	watchon(&t->w, 0);
+	if (t->f->dirfd == -1)
+		return;
+	unlinkat(t->f->dirfd, t->fifo.name, 0);
+	if (t->fd != -1)
+		close(t->fd);
+	if (t->pending.name)
+		unlinkat(t->f->dirfd, t->pending.name, 0);
+	unlinkat(t->f->dirfd, t->stats.name, 0);
+}
+
 static void
 friendcreate(uint32_t frnum)
 {
@@ -1548,6 +4658,7 @@ friendcreate(uint32_t frnum)
 	f = calloc(1, sizeof(*f));
 	if (!f)
 		eprintf("calloc:");
+	f->paths.sz = PATH_MAX;
 
 	i = tox_friend_get_name_size(tox, frnum, &err);
 	if (err != TOX_ERR_FRIEND_QUERY_OK) {
@@ -1561,6 +4672,7 @@ friendcreate(uint32_t frnum)
 	}
 
 	f->num = frnum;
+	f->conn = tox_friend_get_connection_status(tox, frnum, NULL);
 	if (!tox_friend_get_public_key(tox, f->num, f->id, NULL)) {
 		weprintf("Failed to get key for %s\n", f->name);
 		return;
@@ -1580,14 +4692,25 @@ friendcreate(uint32_t frnum)
 		eprintf("dirfd %s:", f->idstr);
 	f->dirfd = r;
 
+	r = mkdirat(f->dirfd, "spool", 0777);
+	if (r < 0 && errno != EEXIST)
+		eprintf("mkdirat %s/spool:", f->idstr);
+
 	for (i = 0; i < LEN(ffiles); i++) {
 		f->fd[i] = -1;
+		watchinit(&f->w[i], &f->fd[i], WFRIEND, f, i);
 		if (ffiles[i].type == FIFO) {
 			fiforeset(f->dirfd, &f->fd[i], ffiles[i]);
 		} else if (ffiles[i].type == STATIC) {
 			f->fd[i] = fifoopen(f->dirfd, ffiles[i]);
 		}
 	}
+	f->w[FCALL_OUT].out = 1;
+	f->w[FVIDEO_OUT].out = 1;
+	for (i = 0; i < MAXTRANSFERS; i++) {
+		transferinit(f, &f->tx[i], 0, i);
+		transferinit(f, &f->rx[i], 1, i);
+	}
 
 	/* Dump name */
 	ftruncate(f->fd[FNAME], 0);
@@ -1595,8 +4718,7 @@ friendcreate(uint32_t frnum)
 
 	/* Dump online state */
 	ftruncate(f->fd[FONLINE], 0);
-	dprintf(f->fd[FONLINE], "%d\n",
-		tox_friend_get_connection_status(tox, frnum, NULL));
+	dprintf(f->fd[FONLINE], "%d\n", f->conn);
 
 	/* Dump status */
 	i = tox_friend_get_status_message_size(tox, frnum, NULL);
@@ -1613,16 +4735,17 @@ friendcreate(uint32_t frnum)
 	ftruncate(f->fd[FSTATE], 0);
 	dprintf(f->fd[FSTATE], "%s\n", ustate[tox_friend_get_status(tox, frnum, NULL)]);
 
-	/* Dump file pending state */
-	ftruncate(f->fd[FFILE_STATE], 0);
-
 	/* Dump call pending state */
 	ftruncate(f->fd[FCALL_STATE], 0);
 	dprintf(f->fd[FCALL_STATE], "none\n");
 
 	f->av.state = 0;
+	friendwatch(f);
 
 	TAILQ_INSERT_TAIL(&friendhead, f, entry);
+	friendtab = tabgrow(friendtab, &friendtabsz, f->num);
+	friendtab[f->num] = f;
+	peerget(f->id, 1)->f = f;
 }
 
 static void
@@ -1655,8 +4778,10 @@ confcreate(uint32_t cnum)
 
 	for (i = 0; i < LEN(cfiles); i++) {
 		c->fd[i] = -1;
+		watchinit(&c->w[i], &c->fd[i], WCONF, c, i);
 		if (cfiles[i].type == FIFO) {
 			fiforeset(c->dirfd, &c->fd[i], cfiles[i]);
+			watchon(&c->w[i], 1);
 		} else if (cfiles[i].type == STATIC) {
 			c->fd[i] = fifoopen(c->dirfd, cfiles[i]);
 		}
@@ -1679,28 +4804,124 @@ confcreate(uint32_t cnum)
 	dprintf(c->fd[CTITLE_OUT], "%s\n", title);
 
 	TAILQ_INSERT_TAIL(&confhead, c, entry);
+	conftab = tabgrow(conftab, &conftabsz, c->num);
+	conftab[c->num] = c;
 
 	logmsg("- %s > Created\n", c->numstr);
 }
 
+/* Remember the sends by path, so they go on after a restart */
+static void
+resumesave(void)
+{
+	struct friend *f;
+	struct transfer *t;
+	FILE  *fp;
+	char   idstr[2 * TOX_FILE_ID_LENGTH + 1], tmp[PATH_MAX];
+	size_t i;
+
+	/* the shutdown tears all transfers down, keep them on disk */
+	if (!running)
+		return;
+	/* a crash or a full disk leaves the old file in place */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", resumefile);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		weprintf("fopen %s:", tmp);
+		return;
+	}
+	/* receives are not kept, the friend offers them anew after a restart */
+	TAILQ_FOREACH(f, &friendhead, entry) {
+		for (i = 0; i < MAXTRANSFERS; i++) {
+			t = &f->tx[i];
+			if (t->state == TRANSFER_NONE || !t->path)
+				continue;
+			id2str(t->id, idstr);
+			fprintf(fp, "%s %s %s\n", f->idstr, idstr, t->path);
+		}
+	}
+	if (fflush(fp) == EOF || fsync(fileno(fp)) < 0) {
+		weprintf("write %s:", tmp);
+		fclose(fp);
+		unlink(tmp);
+		return;
+	}
+	if (fclose(fp) == EOF) {
+		weprintf("fclose %s:", tmp);
+		unlink(tmp);
+		return;
+	}
+	if (rename(tmp, resumefile) < 0)
+		weprintf("rename %s:", tmp);
+}
+
+static void
+resumeload(void)
+{
+	struct peer *p;
+	FILE    *fp;
+	char    *line = NULL, *fid, *path;
+	uint8_t  id[TOX_PUBLIC_KEY_SIZE], fileid[TOX_FILE_ID_LENGTH];
+	size_t   sz = 0, n;
+
+	fp = fopen(resumefile, "r");
+	if (!fp)
+		return;
+	/* <friend id> <file id> <path> */
+	while (getline(&line, &sz, fp) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+		n = strlen(line);
+		if (n < 2 * TOX_PUBLIC_KEY_SIZE + 2 * TOX_FILE_ID_LENGTH + 2 ||
+		    line[2 * TOX_PUBLIC_KEY_SIZE] != ' ' ||
+		    line[2 * TOX_PUBLIC_KEY_SIZE + 2 * TOX_FILE_ID_LENGTH + 1] != ' ')
+			continue;
+		fid = line + 2 * TOX_PUBLIC_KEY_SIZE + 1;
+		path = fid + 2 * TOX_FILE_ID_LENGTH + 1;
+		fid[-1] = path[-1] = '\0';
+		str2id(line, id);
+		str2id(fid, fileid);
+		p = peerget(id, 0);
+		if (p && p->f && offerfile(p->f, path, fileid) == 0)
+			logmsg(": %s : Tx > Kept %s\n", p->f->name, path);
+	}
+	free(line);
+	fclose(fp);
+	resumesave();
+}
+
 static void
 frienddestroy(struct friend *f)
 {
+	struct peer *p;
 	size_t i;
 
-	canceltxtransfer(f);
-	cancelrxtransfer(f);
+	canceltransfers(f);
 	if (f->av.state > 0)
 		cancelcall(f, "Destroying");
 	for (i = 0; i < LEN(ffiles); i++) {
+		watchon(&f->w[i], 0);
 		if (f->dirfd != -1) {
 			unlinkat(f->dirfd, ffiles[i].name, 0);
 			if (f->fd[i] != -1)
 				close(f->fd[i]);
 		}
 	}
+	for (i = 0; i < MAXTRANSFERS; i++) {
+		transferdestroy(&f->tx[i]);
+		transferdestroy(&f->rx[i]);
+	}
+	free(f->paths.buf);
+	/* keep files still waiting in the spool */
+	unlinkat(f->dirfd, "spool", AT_REMOVEDIR);
 	rmdir(f->idstr);
+	if (f->active)
+		TAILQ_REMOVE(&activehead, f, aentry);
 	TAILQ_REMOVE(&friendhead, f, entry);
+	friendtab[f->num] = NULL;
+	if ((p = peerget(f->id, 0))) {
+		p->f = NULL;
+		peerput(p);
+	}
 }
 
 static void
@@ -1709,6 +4930,7 @@ confdestroy(struct conference *c)
 	size_t i;
 
 	for (i = 0; i <LEN(cfiles); i++) {
+		watchon(&c->w[i], 0);
 		if(c->dirfd != -1) {
 			unlinkat(c->dirfd, cfiles[i].name, 0);
 			if (c->fd[i] != -1)
@@ -1717,6 +4939,40 @@ confdestroy(struct conference *c)
 	}
 	rmdir(c->numstr);
 	TAILQ_REMOVE(&confhead, c, entry);
+	conftab[c->num] = NULL;
+}
+
+static void
+requestdestroy(struct request *req)
+{
+	struct peer *p;
+
+	unlinkat(gslots[REQUEST].fd[OUT], req->idstr, 0);
+	watchon(&req->w, 0);
+	if (req->fd != -1)
+		close(req->fd);
+	TAILQ_REMOVE(&reqhead, req, entry);
+	if ((p = peerget(req->id, 0))) {
+		p->req = NULL;
+		peerput(p);
+	}
+	free(req->msg);
+	free(req);
+}
+
+static void
+invitedestroy(struct invite *inv)
+{
+	unlinkat(gslots[CONF].fd[OUT], inv->fifoname, 0);
+	watchon(&inv->w, 0);
+	if (inv->fd != -1)
+		close(inv->fd);
+	TAILQ_REMOVE(&invhead, inv, entry);
+	LIST_REMOVE(inv, pentry);
+	peerput(peerget(inv->id, 0));
+	free(inv->fifoname);
+	free(inv->cookie);
+	free(inv);
 }
 
 static void
@@ -1887,6 +5143,67 @@ out:
 	logmsg("Request > Sent\n");
 }
 
+/*
+ * Send the files named in broadcast/in, one per line, to all friends
+ * or to the friends whose IDs come first on the line
+ */
+static void
+sendbroadcast(void *data)
+{
+	struct friend *f;
+	struct share *sh;
+	struct peer *p;
+	char    idstr[2 * TOX_PUBLIC_KEY_SIZE + 1];
+	char   *line, *path;
+	uint8_t id[TOX_PUBLIC_KEY_SIZE];
+	size_t  i;
+	int     offered = 0;
+
+	if (linesread(&bclines, gslots[BROADCAST].dirfd, &gslots[BROADCAST].fd[IN],
+	              gfiles[IN]) < 0)
+		return;
+
+	while ((line = linesnext(&bclines))) {
+		if (!offered++) {
+			ftruncate(gslots[BROADCAST].fd[ERR], 0);
+			lseek(gslots[BROADCAST].fd[ERR], 0, SEEK_SET);
+		}
+		for (path = line; ; path += sizeof(idstr)) {
+			for (i = 0; i < sizeof(idstr) - 1 && isxdigit((unsigned char)path[i]); i++)
+				;
+			if (i < sizeof(idstr) - 1 || path[i] != ' ')
+				break;
+		}
+		if (!*path)
+			continue;
+		sh = shareopen(path);
+		if (!sh) {
+			dprintf(gslots[BROADCAST].fd[ERR], "Failed to open %s\n", path);
+			continue;
+		}
+		if (path == line) {
+			TAILQ_FOREACH(f, &friendhead, entry)
+				offershare(f, sh);
+		}
+		for (; line < path; line += sizeof(idstr)) {
+			memcpy(idstr, line, sizeof(idstr) - 1);
+			idstr[sizeof(idstr) - 1] = '\0';
+			str2id(idstr, id);
+			p = peerget(id, 0);
+			if (!p || !p->f) {
+				dprintf(gslots[BROADCAST].fd[ERR], "Unknown friend %s\n", idstr);
+				weprintf("Unknown friend %s\n", idstr);
+				continue;
+			}
+			offershare(p->f, sh);
+		}
+		logmsg("Broadcast > %s to %d friends\n", path, sh->refs - 1);
+		shareput(sh);
+	}
+	if (offered)
+		resumesave();
+}
+
 static void
 setnospam(void *data)
 {
@@ -1972,21 +5289,71 @@ newconf(void *data)
 	confcreate(cnum);
 }
 
+static void
+answerrequest(struct request *req)
+{
+	struct   file reqfifo;
+	uint32_t frnum;
+	char     ch;
+
+	reqfifo.name = req->idstr;
+	reqfifo.flags = O_RDONLY | O_NONBLOCK;
+	if (fiforead(gslots[REQUEST].fd[OUT], &req->fd, reqfifo, &ch, 1) != 1)
+		return;
+	if (ch != '0' && ch != '1')
+		return;
+	frnum = tox_friend_add_norequest(tox, req->id, NULL);
+	if (frnum == UINT32_MAX) {
+		weprintf("Failed to add friend %s\n", req->idstr);
+		fiforeset(gslots[REQUEST].fd[OUT], &req->fd, reqfifo);
+		return;
+	}
+	if (ch == '1') {
+		friendcreate(frnum);
+		logmsg("Request : %s > Accepted\n", req->idstr);
+		datasave();
+	} else {
+		tox_friend_delete(tox, frnum, NULL);
+		logmsg("Request : %s > Rejected\n", req->idstr);
+	}
+	requestdestroy(req);
+}
+
+static void
+answerinvite(struct invite *inv)
+{
+	struct   file invfifo;
+	uint32_t cnum;
+	char     ch;
+
+	invfifo.name = inv->fifoname;
+	invfifo.flags = O_RDONLY | O_NONBLOCK;
+	if (fiforead(gslots[CONF].fd[OUT], &inv->fd, invfifo, &ch, 1) != 1)
+		return;
+	if (ch != '0' && ch != '1')
+		return;
+	else if (ch == '1'){
+		cnum = tox_conference_join(tox, inv->inviter, (uint8_t *)inv->cookie,
+					   inv->cookielen, NULL);
+		if(cnum == UINT32_MAX)
+			weprintf("Failed to join conference\n");
+		else
+			confcreate(cnum);
+	}
+	invitedestroy(inv);
+}
+
 static void
 loop(void)
 {
-	struct file reqfifo, invfifo;
 	struct friend *f, *ftmp;
-	struct request *req, *rtmp;
-	struct conference *c, *ctmp;
-	struct invite *inv, *itmp;
-	struct timeval tv;
-	fd_set rfds;
-	time_t t0, t1, c0, c1;
-	size_t i;
-	int    connected = 0, n, r, fd, fdmax;
-	char   tstamp[64], ch;
-	uint32_t frnum, cnum;
+	struct conference *c;
+	struct transfer *t;
+	struct watch *w;
+	time_t t0, t1;
+	uint64_t nextprobe = 0, nextstats = 0, nextspool = 0;
+	uint32_t callwait = UINT32_MAX;
+	int    connected = 0, i, n, r, fd, ndefer, probe;
 
 	t0 = time(NULL);
 	logmsg("DHT > Connecting\n");
@@ -1996,10 +5363,6 @@ loop(void)
 		if (tox_self_get_connection_status(tox) != TOX_CONNECTION_NONE) {
 			if (!connected) {
 				logmsg("DHT > Connected\n");
-				TAILQ_FOREACH(f, &friendhead, entry) {
-					canceltxtransfer(f);
-					cancelrxtransfer(f);
-				}
 				connected = 1;
 			}
 		} else {
@@ -2015,125 +5378,130 @@ loop(void)
 			}
 		}
 		tox_iterate(tox, NULL);
-		toxav_iterate(toxav);
-
-		/* Prepare select-fd-set */
-		FD_ZERO(&rfds);
-		fdmax = -1;
-
-		for (i = 0; i < LEN(gslots); i++)
-			FD_APPEND(gslots[i].fd[IN]);
-
-		TAILQ_FOREACH(req, &reqhead, entry)
-			FD_APPEND(req->fd);
+		if (!avthread)
+			toxav_iterate(toxav);
+		else
+			avdrain();
 
-		TAILQ_FOREACH(inv, &invhead, entry)
-			FD_APPEND(inv->fd);
-
-		TAILQ_FOREACH(f, &friendhead, entry) {
-			/* Only monitor friends that are online */
-			if (tox_friend_get_connection_status(tox, f->num, NULL) != TOX_CONNECTION_NONE) {
-				FD_APPEND(f->fd[FTEXT_IN]);
-
-				if (f->tx.state == TRANSFER_NONE)
-					FD_APPEND(f->fd[FFILE_IN]);
-				if (!f->av.state || (f->av.state & TRANSMITTING))
-					FD_APPEND(f->fd[FCALL_IN]);
-			}
-			FD_APPEND(f->fd[FREMOVE]);
-		}
-
-		TAILQ_FOREACH(c, &confhead, entry) {
-			FD_APPEND(c->fd[CLEAVE]);
-			FD_APPEND(c->fd[CTITLE_IN]);
-			FD_APPEND(c->fd[CTEXT_IN]);
-			FD_APPEND(c->fd[CINVITE]);
-		}
-
-		tv.tv_sec = 0;
-		tv.tv_usec = interval(tox, toxav) * 1000;
-		n = select(fdmax + 1, &rfds, NULL, NULL, &tv);
+		n = evwait(MIN(interval(tox, toxav), callwait));
 		if (n < 0) {
 			if (errno == EINTR)
 				continue;
-			eprintf("select:");
+			eprintf("evwait:");
+		}
+
+		/*
+		 * Readers leaving file_out, call_out and video_out are reported
+		 * by the event backend, but a reader showing up can only be
+		 * noticed by opening the FIFO, so only try that every
+		 * READERDELAY ms.
+		 */
+		probe = 0;
+		if (mstime() >= nextprobe) {
+			probe = 1;
+			nextprobe = mstime() + READERDELAY;
 		}
 
-		/* Check for broken transfers (friend went offline, file_out was closed) */
-		TAILQ_FOREACH(f, &friendhead, entry) {
-			if (tox_friend_get_connection_status(tox, f->num, NULL) == TOX_CONNECTION_NONE) {
-				canceltxtransfer(f);
-				cancelrxtransfer(f);
+		/*
+		 * Sample the counters of running transfers, and give up on
+		 * those that were cut off and not picked up again
+		 */
+		if (mstime() >= nextstats) {
+			nextstats = mstime() + STATSDELAY;
+			for (f = TAILQ_FIRST(&activehead); f; f = ftmp) {
+				ftmp = TAILQ_NEXT(f, aentry);
+				expiretransfers(f);
+				if (f->av.state)
+					writecallstats(f);
+				for (i = 0; i < MAXTRANSFERS; i++) {
+					if (f->tx[i].state != TRANSFER_NONE)
+						statswrite(&f->tx[i]);
+					if (f->rx[i].state != TRANSFER_NONE)
+						statswrite(&f->rx[i]);
+				}
 			}
-			if (f->rxstate != TRANSFER_INPROGRESS)
-				continue;
-			fd = fifoopen(f->dirfd, ffiles[FFILE_OUT]);
-			if (fd < 0) {
-				cancelrxtransfer(f);
-			} else {
-				close(fd);
+		}
+
+		/* Offer waiting paths and files dropped into spool directories */
+		if (mstime() >= nextspool) {
+			nextspool = mstime() + SPOOLDELAY;
+			TAILQ_FOREACH(f, &friendhead, entry) {
+				if (linesready(&f->paths))
+					offerpaths(f);
+				spoolfriend(f);
 			}
 		}
 
 		/* Accept pending transfers if any */
-		TAILQ_FOREACH(f, &friendhead, entry) {
-			if (tox_friend_get_connection_status(tox, f->num, NULL) == 0)
-				continue;
-			if (f->rxstate == TRANSFER_NONE)
-				continue;
-			if (f->fd[FFILE_OUT] >= 0)
-				continue;
-			r = fifoopen(f->dirfd, ffiles[FFILE_OUT]);
-			if (r < 0)
-				continue;
-			f->fd[FFILE_OUT] = r;
-			if (!tox_file_control(tox, f->num, f->tx.fnum, TOX_FILE_CONTROL_RESUME, NULL)) {
-				weprintf("Failed to accept transfer from receiver\n");
-				cancelrxtransfer(f);
-			} else {
-				logmsg(": %s : Rx > Accepted\n", f->name);
-				f->rxstate = TRANSFER_INPROGRESS;
+		for (f = TAILQ_FIRST(&activehead); probe && f; f = ftmp) {
+			ftmp = TAILQ_NEXT(f, aentry);
+			for (i = 0; i < MAXTRANSFERS; i++) {
+				t = &f->rx[i];
+				if (t->state != TRANSFER_PENDING || t->fd >= 0)
+					continue;
+				r = fifoopen(f->dirfd, t->fifo);
+				if (r < 0)
+					continue;
+				t->fd = r;
+				watchon(&t->w, 1);
+				if (!tox_file_control(tox, f->num, t->fnum, TOX_FILE_CONTROL_RESUME, NULL)) {
+					weprintf("Failed to accept transfer from receiver\n");
+					cancelrxtransfer(t);
+				} else {
+					logmsg(": %s : %s > Accepted\n", f->name, t->tag);
+					ringinit(&t->ring, RXBUFSIZE);
+					t->state = TRANSFER_INPROGRESS;
+				}
 			}
 		}
 
-
-		/* Answer pending calls */
-		TAILQ_FOREACH(f, &friendhead, entry) {
-			if (tox_friend_get_connection_status(tox, f->num, NULL) == TOX_CONNECTION_NONE)
-				continue;
+		/* Answer pending calls, send and play their audio */
+		callwait = UINT32_MAX;
+		for (f = TAILQ_FIRST(&activehead); f; f = ftmp) {
+			ftmp = TAILQ_NEXT(f, aentry);
 			if (!f->av.state)
 				continue;
 
-			fd = fifoopen(f->dirfd, ffiles[FCALL_OUT]);
-			if (fd < 0) {
-				f->av.state &= ~INCOMING;
-			} else {
-				f->av.state |= INCOMING;
-				if (f->fd[FCALL_OUT] >= 0)
-					close(fd);
-				else
+			callwait = MIN(callwait, sendcall(f));
+			ratecall(f);
+			if ((f->av.state & INCOMING) && f->av.tick)
+				callwait = MIN(callwait, playcall(f));
+			/* pick up what the audio thread received in time */
+			if (avthread && ((f->av.state & INCOMING) || f->fd[FVIDEO_OUT] >= 0))
+				callwait = MIN(callwait, f->av.fmt.ms);
+
+			if (probe && f->fd[FCALL_OUT] < 0) {
+				fd = fifoopen(f->dirfd, ffiles[FCALL_OUT]);
+				if (fd >= 0) {
 					f->fd[FCALL_OUT] = fd;
+					watchon(&f->w[FCALL_OUT], 1);
+					f->av.state |= INCOMING;
+				}
+			}
+			if (probe && f->fd[FVIDEO_OUT] < 0) {
+				fd = fifoopen(f->dirfd, ffiles[FVIDEO_OUT]);
+				if (fd >= 0) {
+					f->fd[FVIDEO_OUT] = fd;
+					watchon(&f->w[FVIDEO_OUT], 1);
+				}
 			}
 
 			if (f->av.state == TRANSMITTING)
 				cancelcall(f, "Hung up");
 
 			if (f->av.state & RINGING) {
-				if (f->av.state & OUTGOING) {
-					c1 = time(NULL);
-					if (c1 > c0 + RINGINGDELAY)
-						cancelcall(f, "Timeout");
-				}
+				if ((f->av.state & OUTGOING) && mstime() > f->av.ringuntil)
+					cancelcall(f, "Timeout");
 				if (!(f->av.state & INCOMING))
 					continue;
-				if (!toxav_answer(toxav, f->num, AUDIOBITRATE, 0, NULL)) {
+				if (!toxav_answer(toxav, f->num, f->av.bitrate, VIDEOBITRATE, NULL)) {
 					weprintf("Failed to answer call\n");
-					if (!toxav_call_control(toxav, f->num, TOXAV_CALL_CONTROL_CANCEL, NULL))
-						weprintf("Failed to reject call\n");
-					break;
+					cancelcall(f, "Failed");
+					continue;
 				}
 				f->av.state &= ~RINGING;
 				f->av.state |= TRANSMITTING;
+				friendwatch(f);
 				logmsg(": %s : Audio > Answered\n", f->name);
 				ftruncate(f->fd[FCALL_STATE], 0);
 				lseek(f->fd[FCALL_STATE], 0, SEEK_SET);
@@ -2141,135 +5509,101 @@ loop(void)
 			}
 		}
 
-		if (n == 0)
-			continue;
-
-		for (i = 0; i < LEN(gslots); i++) {
-			if (FD_ISSET(gslots[i].fd[IN], &rfds) == 0)
-				continue;
-			(*gslots[i].cb)(NULL);
-		}
-
-		for (req = TAILQ_FIRST(&reqhead); req; req = rtmp) {
-			rtmp = TAILQ_NEXT(req, entry);
-			if (FD_ISSET(req->fd, &rfds) == 0)
-				continue;
-			reqfifo.name = req->idstr;
-			reqfifo.flags = O_RDONLY | O_NONBLOCK;
-			if (fiforead(gslots[REQUEST].fd[OUT], &req->fd, reqfifo,
-				     &ch, 1) != 1)
-				continue;
-			if (ch != '0' && ch != '1')
-				continue;
-			frnum = tox_friend_add_norequest(tox, req->id, NULL);
-			if (frnum == UINT32_MAX) {
-				weprintf("Failed to add friend %s\n", req->idstr);
-				fiforeset(gslots[REQUEST].fd[OUT], &req->fd, reqfifo);
-				continue;
-			}
-			if (ch == '1') {
-				friendcreate(frnum);
-				logmsg("Request : %s > Accepted\n", req->idstr);
-				datasave();
-			} else {
-				tox_friend_delete(tox, frnum, NULL);
-				logmsg("Request : %s > Rejected\n", req->idstr);
-			}
-			unlinkat(gslots[REQUEST].fd[OUT], req->idstr, 0);
-			close(req->fd);
-			TAILQ_REMOVE(&reqhead, req, entry);
-			free(req->msg);
-			free(req);
-		}
-
-		for (inv = TAILQ_FIRST(&invhead); inv; inv = itmp) {
-			itmp = TAILQ_NEXT(inv, entry);
-			if (FD_ISSET(inv->fd, &rfds) == 0)
-				continue;
-			invfifo.name = inv->fifoname;
-			invfifo.flags = O_RDONLY | O_NONBLOCK;
-			if (fiforead(gslots[CONF].fd[OUT], &inv->fd, invfifo,
-			    &ch, 1) != 1)
-				continue;
-			if (ch != '0' && ch != '1')
-				continue;
-			else if (ch == '1'){
-				cnum = tox_conference_join(tox, inv->inviter, (uint8_t *)inv->cookie,
-							   inv->cookielen, NULL);
-				if(cnum == UINT32_MAX)
-					weprintf("Failed to join conference\n");
-				else
-					confcreate(cnum);
-			}
-			unlinkat(gslots[CONF].fd[OUT], inv->fifoname, 0);
-			close(inv->fd);
-			TAILQ_REMOVE(&invhead, inv, entry);
-			free(inv->fifoname);
-			free(inv->cookie);
-			free(inv);
-		}
-
-		for (c = TAILQ_FIRST(&confhead); c; c = ctmp) {
-			ctmp = TAILQ_NEXT(c, entry);
-			if (FD_ISSET(c->fd[CINVITE], &rfds))
-				invitefriend(c);
-			if (FD_ISSET(c->fd[CLEAVE], &rfds)) {
-				logmsg("- %s > Leave\n", c->numstr);
-				tox_conference_delete(tox, c->num, NULL);
-				confdestroy(c);
-			}
-			if (FD_ISSET(c->fd[CTEXT_IN], &rfds))
-				sendconftext(c);
-			if (FD_ISSET(c->fd[CTITLE_IN], &rfds))
-				updatetitle(c);
-		}
-
-		for (f = TAILQ_FIRST(&friendhead); f; f = ftmp) {
-			ftmp = TAILQ_NEXT(f, entry);
-			if (FD_ISSET(f->fd[FTEXT_IN], &rfds))
-				sendfriendtext(f);
-			if (FD_ISSET(f->fd[FFILE_IN], &rfds) && f->tx.state == TRANSFER_NONE) {
-				/* Prepare a new transfer */
-				snprintf(tstamp, sizeof(tstamp), "%lu", (unsigned long)time(NULL));
-				f->tx.fnum = tox_file_send(tox, f->num, TOX_FILE_KIND_DATA, UINT64_MAX,
-				                           NULL, (uint8_t *)tstamp, strlen(tstamp), NULL);
-				if (f->tx.fnum == UINT32_MAX) {
-					weprintf("Failed to initiate new transfer\n");
-					fiforeset(f->dirfd, &f->fd[FFILE_IN], ffiles[FFILE_IN]);
-				} else {
-					f->tx.state = TRANSFER_INITIATED;
-					logmsg(": %s : Tx > Initiated\n", f->name);
-				}
-			}
-			if (FD_ISSET(f->fd[FCALL_IN], &rfds)) {
-				if (!f->av.state) {
-					if (!toxav_call(toxav, f->num, AUDIOBITRATE, 0, NULL)) {
-						weprintf("Failed to call\n");
-						fiforeset(f->dirfd, &f->fd[FCALL_IN], ffiles[FCALL_IN]);
-						break;
-					}
-
-					f->av.state |= RINGING;
-					logmsg(": %s : Audio > Tx Inviting\n", f->name);
+		/*
+		 * Removing a friend or leaving a conference frees descriptors
+		 * other ready watches may still refer to, so do it last.
+		 */
+		for (ndefer = 0, i = 0; i < n; i++) {
+			w = evready[i];
+			switch (w->type) {
+			case WSLOT:
+				(*((struct slot *)w->p)->cb)(NULL);
+				break;
+			case WREQUEST:
+				answerrequest(w->p);
+				break;
+			case WINVITE:
+				answerinvite(w->p);
+				break;
+			case WFRIEND:
+				f = w->p;
+				switch (w->idx) {
+				case FTEXT_IN:
+					sendfriendtext(f);
+					break;
+				case FFILE_PATH:
+					sendfriendpath(f);
+					break;
+				case FCALL_IN:
+					callfriend(f);
+					callwait = MIN(callwait, sendcall(f));
+					break;
+				case FCALL_OUT:
+					watchclose(w);
+					f->av.state &= ~INCOMING;
+					break;
+				case FVIDEO_IN:
+					sendfriendvideo(f);
+					break;
+				case FVIDEO_OUT:
+					flushvideo(f);
+					break;
+				case FREMOVE:
+					evready[ndefer++] = w;
+					break;
 				}
-				if (!(f->av.state & OUTGOING)) {
-					c0 = time(NULL);
-					f->av.n = 0;
-					f->av.lastsent.tv_sec = 0;
-					f->av.lastsent.tv_nsec = 0;
-
-					f->av.frame = malloc(sizeof(int16_t) * framesize);
-					if (!f->av.frame)
-						eprintf("malloc:");
-
-					f->av.state |= OUTGOING;
+				break;
+			case WTRANSFER:
+				t = w->p;
+				/* turned off by an earlier event of this batch */
+				if (!w->on)
+					break;
+				if (!t->w.out) {
+					if (t->state == TRANSFER_NONE)
+						sendfriendfile(t);
+					else if (t->filefd < 0)
+						readfriendfile(t);
+				} else if (!t->ring.len) {
+					/* with nothing queued, only an error wakes us up */
+					cancelrxtransfer(t);
 				} else {
-					if (f->av.state & TRANSMITTING)
-						sendfriendcalldata(f);
+					flushrxtransfer(t);
+				}
+				break;
+			case WCONF:
+				c = w->p;
+				switch (w->idx) {
+				case CINVITE:
+					invitefriend(c);
+					break;
+				case CTEXT_IN:
+					sendconftext(c);
+					break;
+				case CTITLE_IN:
+					updatetitle(c);
+					break;
+				case CLEAVE:
+					evready[ndefer++] = w;
+					break;
 				}
+				break;
 			}
-			if (FD_ISSET(f->fd[FREMOVE], &rfds))
-				removefriend(f);
+		}
+		for (i = 0; i < ndefer; i++) {
+			w = evready[i];
+			if (w->type == WFRIEND)
+				removefriend(w->p);
+			else
+				leaveconf(w->p);
+		}
+
+		/*
+		 * Retry file chunks toxcore had no room for, or that had to
+		 * wait for tokens, once calls and texts had their turn
+		 */
+		for (f = TAILQ_FIRST(&activehead); f; f = ftmp) {
+			ftmp = TAILQ_NEXT(f, aentry);
+			sendfriendfiledata(f);
 		}
 	}
 }
@@ -2296,6 +5630,7 @@ toxshutdown(void)
 	/* Friends */
 	for (f = TAILQ_FIRST(&friendhead); f; f = ftmp) {
 		ftmp = TAILQ_NEXT(f, entry);
+		suspendtransfers(f);
 		frienddestroy(f);
 	}
 
@@ -2308,30 +5643,13 @@ toxshutdown(void)
 	/* Requests */
 	for (r = TAILQ_FIRST(&reqhead); r; r = rtmp) {
 		rtmp = TAILQ_NEXT(r, entry);
-
-		if (gslots[REQUEST].fd[OUT] != -1) {
-			unlinkat(gslots[REQUEST].fd[OUT], r->idstr, 0);
-			if (r->fd != -1)
-				close(r->fd);
-		}
-		TAILQ_REMOVE(&reqhead, r, entry);
-		free(r->msg);
-		free(r);
+		requestdestroy(r);
 	}
 
 	/* Invites */
 	for (i = TAILQ_FIRST(&invhead); i; i = itmp) {
 		itmp = TAILQ_NEXT(i, entry);
-
-		if(gslots[CONF].fd[OUT] != -1) {
-			unlinkat(gslots[CONF].fd[OUT], i->fifoname, 0);
-			if (i->fd != -1)
-				close(i->fd);
-		}
-		TAILQ_REMOVE(&invhead, i, entry);
-		free(i->fifoname);
-		free(i->cookie);
-		free(i);
+		invitedestroy(i);
 	}
 
 	/* Global files and slots */
@@ -2351,6 +5669,15 @@ toxshutdown(void)
 	if (idfd != -1)
 		close(idfd);
 
+#ifdef USEEPOLL
+	close(epfd);
+#endif
+	free(fdwatch);
+	free(friendtab);
+	free(conftab);
+	free(peertab);
+
+	avshutdown();
 	toxav_kill(toxav);
 	tox_kill(tox);
 }
@@ -2422,8 +5749,12 @@ main(int argc, char *argv[])
 	if (!quiet)
 		printrat();
 	toxinit();
+	avinit();
+	evinit();
+	peerinit();
 	localinit();
 	friendload();
+	resumeload();
 	loop();
 	toxshutdown();
 